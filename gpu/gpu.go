@@ -18,6 +18,7 @@ import (
 	"runtime"
 	"strings"
 	"sync"
+	"time"
 	"unsafe"
 
 	"github.com/ollama/ollama/format"
@@ -26,6 +27,7 @@ import (
 type handles struct {
 	deviceCount int
 	cudart      *C.cudart_handle_t
+	nvml        *C.nvml_handle_t
 }
 
 const (
@@ -62,6 +64,22 @@ var CudartWindowsGlobs = []string{
 	"c:\\Program Files\\NVIDIA GPU Computing Toolkit\\CUDA\\v*\\bin\\cudart64_*.dll",
 }
 
+var NvmlLinuxGlobs = []string{
+	"/usr/lib/x86_64-linux-gnu/nvidia/current/libnvidia-ml.so*",
+	"/usr/lib/x86_64-linux-gnu/libnvidia-ml.so*",
+	"/usr/lib/wsl/lib/libnvidia-ml.so*",
+	"/usr/lib/wsl/drivers/*/libnvidia-ml.so*",
+	"/opt/cuda/lib64/libnvidia-ml.so*",
+	"/usr/lib/aarch64-linux-gnu/nvidia/current/libnvidia-ml.so*",
+	"/usr/lib/aarch64-linux-gnu/libnvidia-ml.so*",
+	"/usr/lib*/libnvidia-ml.so*",
+	"/usr/local/lib*/libnvidia-ml.so*",
+}
+
+var NvmlWindowsGlobs = []string{
+	"c:\\Windows\\System32\\nvml.dll",
+}
+
 // Jetson devices have JETSON_JETPACK="x.y.z" factory set to the Jetpack version installed.
 // Included to drive logic for reducing Ollama-allocated overhead on L4T/Jetson devices.
 var CudaTegra string = os.Getenv("JETSON_JETPACK")
@@ -74,6 +92,8 @@ func initGPUHandles() *handles {
 	gpuHandles := &handles{}
 	var cudartMgmtName string
 	var cudartMgmtPatterns []string
+	var nvmlMgmtName string
+	var nvmlMgmtPatterns []string
 
 	tmpDir, _ := PayloadsDir()
 	switch runtime.GOOS {
@@ -82,6 +102,8 @@ func initGPUHandles() *handles {
 		localAppData := os.Getenv("LOCALAPPDATA")
 		cudartMgmtPatterns = []string{filepath.Join(localAppData, "Programs", "Ollama", cudartMgmtName)}
 		cudartMgmtPatterns = append(cudartMgmtPatterns, CudartWindowsGlobs...)
+		nvmlMgmtName = "nvml.dll"
+		nvmlMgmtPatterns = NvmlWindowsGlobs
 	case "linux":
 		cudartMgmtName = "libcudart.so*"
 		if tmpDir != "" {
@@ -89,11 +111,27 @@ func initGPUHandles() *handles {
 			cudartMgmtPatterns = []string{filepath.Join(tmpDir, "cuda*", cudartMgmtName)}
 		}
 		cudartMgmtPatterns = append(cudartMgmtPatterns, CudartLinuxGlobs...)
+		nvmlMgmtName = "libnvidia-ml.so*"
+		nvmlMgmtPatterns = NvmlLinuxGlobs
 	default:
 		return gpuHandles
 	}
 
 	slog.Info("Detecting GPUs")
+
+	// NVML first - it reads counters straight from the driver without
+	// creating a CUDA context on the device, so probes are much cheaper
+	nvmlLibPaths := FindGPULibs(nvmlMgmtName, nvmlMgmtPatterns)
+	if len(nvmlLibPaths) > 0 {
+		deviceCount, nvml, libPath := LoadNVMLMgmt(nvmlLibPaths)
+		if nvml != nil {
+			slog.Info("detected GPUs", "library", libPath, "count", deviceCount)
+			gpuHandles.nvml = nvml
+			gpuHandles.deviceCount = deviceCount
+			return gpuHandles
+		}
+	}
+
 	cudartLibPaths := FindGPULibs(cudartMgmtName, cudartMgmtPatterns)
 	if len(cudartLibPaths) > 0 {
 		deviceCount, cudart, libPath := LoadCUDARTMgmt(cudartLibPaths)
@@ -107,17 +145,50 @@ func initGPUHandles() *handles {
 	return gpuHandles
 }
 
+// Probe results are cached for this long; the scheduler polls free VRAM
+// before every load and a full probe costs driver round-trips per device
+const gpuInfoTTL = 2 * time.Second
+
+var (
+	gpuInfoCache   GpuInfoList
+	gpuInfoFetched time.Time
+)
+
+// GetGPUInfo returns the most recent probe results, re-probing only when the
+// cached snapshot is older than gpuInfoTTL. Callers that need up-to-date free
+// memory (e.g. right after unloading a model) should use RefreshGPUInfo.
 func GetGPUInfo() GpuInfoList {
-	// TODO - consider exploring lspci (and equivalent on windows) to check for
-	// GPUs so we can report warnings if we see Nvidia/AMD but fail to load the libraries
 	gpuMutex.Lock()
 	defer gpuMutex.Unlock()
+	if gpuInfoCache != nil && time.Since(gpuInfoFetched) < gpuInfoTTL {
+		return append(GpuInfoList{}, gpuInfoCache...)
+	}
+	resp := getGPUInfo()
+	gpuInfoCache = append(GpuInfoList{}, resp...)
+	gpuInfoFetched = time.Now()
+	return resp
+}
 
+// RefreshGPUInfo drops the cached snapshot and probes again immediately
+func RefreshGPUInfo() GpuInfoList {
+	gpuMutex.Lock()
+	gpuInfoCache = nil
+	gpuMutex.Unlock()
+	return GetGPUInfo()
+}
+
+// Note: gpuMutex must already be held
+func getGPUInfo() GpuInfoList {
+	// TODO - consider exploring lspci (and equivalent on windows) to check for
+	// GPUs so we can report warnings if we see Nvidia/AMD but fail to load the libraries
 	gpuHandles := initGPUHandles()
 	defer func() {
 		if gpuHandles.cudart != nil {
 			C.cudart_release(*gpuHandles.cudart)
 		}
+		if gpuHandles.nvml != nil {
+			C.nvml_release(*gpuHandles.nvml)
+		}
 	}()
 
 	// All our GPU builds on x86 have AVX enabled, so fallback to CPU if we don't detect at least AVX
@@ -138,7 +209,11 @@ func GetGPUInfo() GpuInfoList {
 		gpuInfo := GpuInfo{
 			Library: "cuda",
 		}
-		C.cudart_check_vram(*gpuHandles.cudart, C.int(i), &memInfo)
+		if gpuHandles.nvml != nil {
+			C.nvml_check_vram(*gpuHandles.nvml, C.int(i), &memInfo)
+		} else {
+			C.cudart_check_vram(*gpuHandles.cudart, C.int(i), &memInfo)
+		}
 		if memInfo.err != nil {
 			slog.Info("error looking up nvidia GPU memory", "error", C.GoString(memInfo.err))
 			C.free(unsafe.Pointer(memInfo.err))
@@ -250,6 +325,23 @@ func FindGPULibs(baseLibName string, patterns []string) []string {
 	return gpuLibPaths
 }
 
+func LoadNVMLMgmt(nvmlLibPaths []string) (int, *C.nvml_handle_t, string) {
+	var resp C.nvml_init_resp_t
+	resp.nh.verbose = getVerboseState()
+	for _, libPath := range nvmlLibPaths {
+		lib := C.CString(libPath)
+		defer C.free(unsafe.Pointer(lib))
+		C.nvml_init(lib, &resp)
+		if resp.err != nil {
+			slog.Debug("Unable to load nvml", "library", libPath, "error", C.GoString(resp.err))
+			C.free(unsafe.Pointer(resp.err))
+		} else {
+			return int(resp.num_devices), &resp.nh, libPath
+		}
+	}
+	return 0, nil, ""
+}
+
 func LoadCUDARTMgmt(cudartLibPaths []string) (int, *C.cudart_handle_t, string) {
 	var resp C.cudart_init_resp_t
 	resp.ch.verbose = getVerboseState()
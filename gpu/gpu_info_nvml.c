@@ -0,0 +1,138 @@
+#ifndef __APPLE__  // TODO - maybe consider nvidia support on intel macs?
+
+#include <string.h>
+#include "gpu_info_nvml.h"
+
+void nvml_init(char *nvml_lib_path, nvml_init_resp_t *resp) {
+  nvmlReturn_t ret;
+  resp->err = NULL;
+  resp->num_devices = 0;
+  const int buflen = 256;
+  char buf[buflen + 1];
+  int i;
+
+  struct lookup {
+    char *s;
+    void **p;
+  } l[] = {
+      {"nvmlInit_v2", (void *)&resp->nh.nvmlInit_v2},
+      {"nvmlShutdown", (void *)&resp->nh.nvmlShutdown},
+      {"nvmlDeviceGetCount_v2", (void *)&resp->nh.nvmlDeviceGetCount_v2},
+      {"nvmlDeviceGetHandleByIndex_v2", (void *)&resp->nh.nvmlDeviceGetHandleByIndex},
+      {"nvmlDeviceGetMemoryInfo", (void *)&resp->nh.nvmlDeviceGetMemoryInfo},
+      {"nvmlDeviceGetCudaComputeCapability", (void *)&resp->nh.nvmlDeviceGetCudaComputeCapability},
+      {"nvmlDeviceGetUUID", (void *)&resp->nh.nvmlDeviceGetUUID},
+      {NULL, NULL},
+  };
+
+  resp->nh.handle = LOAD_LIBRARY(nvml_lib_path, RTLD_LAZY);
+  if (!resp->nh.handle) {
+    char *msg = LOAD_ERR();
+    LOG(resp->nh.verbose, "library %s load err: %s\n", nvml_lib_path, msg);
+    snprintf(buf, buflen,
+            "Unable to load %s library to query for Nvidia GPUs: %s",
+            nvml_lib_path, msg);
+    free(msg);
+    resp->err = strdup(buf);
+    return;
+  }
+
+  for (i = 0; l[i].s != NULL; i++) {
+    *l[i].p = LOAD_SYMBOL(resp->nh.handle, l[i].s);
+    if (!l[i].p) {
+      char *msg = LOAD_ERR();
+      LOG(resp->nh.verbose, "dlerr: %s\n", msg);
+      UNLOAD_LIBRARY(resp->nh.handle);
+      resp->nh.handle = NULL;
+      snprintf(buf, buflen, "symbol lookup for %s failed: %s", l[i].s,
+              msg);
+      free(msg);
+      resp->err = strdup(buf);
+      return;
+    }
+  }
+
+  // NVML reads memory counters from the driver directly, so unlike cudart
+  // this does not create a CUDA context on any device
+  ret = (*resp->nh.nvmlInit_v2)();
+  if (ret != NVML_SUCCESS) {
+    LOG(resp->nh.verbose, "nvmlInit_v2 err: %d\n", ret);
+    UNLOAD_LIBRARY(resp->nh.handle);
+    resp->nh.handle = NULL;
+    snprintf(buf, buflen, "nvml init failure: %d", ret);
+    resp->err = strdup(buf);
+    return;
+  }
+
+  unsigned int count = 0;
+  ret = (*resp->nh.nvmlDeviceGetCount_v2)(&count);
+  if (ret != NVML_SUCCESS) {
+    LOG(resp->nh.verbose, "nvmlDeviceGetCount_v2 err: %d\n", ret);
+    (*resp->nh.nvmlShutdown)();
+    UNLOAD_LIBRARY(resp->nh.handle);
+    resp->nh.handle = NULL;
+    snprintf(buf, buflen, "unable to get device count: %d", ret);
+    resp->err = strdup(buf);
+    return;
+  }
+  resp->num_devices = (int)count;
+}
+
+void nvml_check_vram(nvml_handle_t h, int i, mem_info_t *resp) {
+  resp->err = NULL;
+  nvmlDevice_t device;
+  nvmlMemory_t memInfo = {0, 0, 0};
+  nvmlReturn_t ret;
+  const int buflen = 256;
+  char buf[buflen + 1];
+
+  if (h.handle == NULL) {
+    resp->err = strdup("nvml handle isn't initialized");
+    return;
+  }
+
+  ret = (*h.nvmlDeviceGetHandleByIndex)(i, &device);
+  if (ret != NVML_SUCCESS) {
+    snprintf(buf, buflen, "unable to get device handle %d: %d", i, ret);
+    resp->err = strdup(buf);
+    return;
+  }
+
+  ret = (*h.nvmlDeviceGetUUID)(device, &resp->gpu_id[0], GPU_ID_LEN);
+  if (ret != NVML_SUCCESS) {
+    LOG(h.verbose, "[%d] device uuid lookup failure: %d\n", i, ret);
+    snprintf(&resp->gpu_id[0], GPU_ID_LEN, "%d", i);
+  }
+
+  resp->major = 0;
+  resp->minor = 0;
+  ret = (*h.nvmlDeviceGetCudaComputeCapability)(device, &resp->major, &resp->minor);
+  if (ret != NVML_SUCCESS) {
+    LOG(h.verbose, "[%d] device compute capability lookup failure: %d\n", i, ret);
+  }
+
+  ret = (*h.nvmlDeviceGetMemoryInfo)(device, &memInfo);
+  if (ret != NVML_SUCCESS) {
+    snprintf(buf, buflen, "nvml device memory info lookup failure %d", ret);
+    resp->err = strdup(buf);
+    return;
+  }
+
+  resp->total = memInfo.total;
+  resp->free = memInfo.free;
+
+  LOG(h.verbose, "[%s] NVML totalMem %llu\n", resp->gpu_id, memInfo.total);
+  LOG(h.verbose, "[%s] NVML freeMem %llu\n", resp->gpu_id, memInfo.free);
+  LOG(h.verbose, "[%s] Compute Capability %d.%d\n", resp->gpu_id, resp->major, resp->minor);
+}
+
+void nvml_release(nvml_handle_t h) {
+  LOG(h.verbose, "releasing nvml library\n");
+  if (h.handle != NULL) {
+    (*h.nvmlShutdown)();
+    UNLOAD_LIBRARY(h.handle);
+  }
+  h.handle = NULL;
+}
+
+#endif  // __APPLE__
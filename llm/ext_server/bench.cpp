@@ -0,0 +1,251 @@
+// Synthetic benchmark harness for the ext_server scheduler. Links the same
+// llama_server_context as ollama_llama_server and drives the task queue with
+// generated completion requests, so batching and scheduler changes can be
+// measured without the Go stack or an external load generator.
+//
+// Example:
+//   ollama_llama_bench -m model.gguf -np 4 -r 32 --prompt-tokens 256 --gen-tokens 64
+
+#define LLAMA_SERVER_MAIN_DISABLED
+#include "server.cpp"
+
+#include <random>
+
+struct bench_params {
+    std::string model;
+
+    int32_t n_slots         = 4;    // parallel slots (-np)
+    int32_t n_requests      = 32;   // total completion requests (-r)
+    int32_t n_prompt_tokens = 256;  // mean synthetic prompt length
+    int32_t n_gen_tokens    = 64;   // tokens generated per request
+    int32_t n_ctx           = 0;    // 0 = n_slots * 2 * (prompt + gen)
+    int32_t n_gpu_layers    = 0;
+    float   cache_hit_ratio = 0.0f; // fraction of requests reusing the previous prompt
+    uint32_t seed           = 42;
+};
+
+struct bench_stats {
+    std::mutex mutex;
+    std::vector<double> ttft_ms;        // time to first streamed token
+    std::vector<double> inter_token_ms; // gaps between streamed chunks
+    double prompt_tokens = 0, prompt_ms = 0;
+    double gen_tokens    = 0, gen_ms    = 0;
+};
+
+static double percentile(std::vector<double> &v, double p) {
+    if (v.empty()) {
+        return 0.0;
+    }
+    std::sort(v.begin(), v.end());
+    const size_t i = std::min(v.size() - 1, (size_t) (p * v.size()));
+    return v[i];
+}
+
+// a prompt of roughly n tokens - simple words tokenize to about one token each
+static std::string synthetic_prompt(std::mt19937 &rng, int n_tokens) {
+    static const char *words[] = {
+        "the", "quick", "brown", "fox", "jumps", "over", "lazy", "dog",
+        "time", "light", "river", "stone", "cloud", "field", "night", "morning",
+    };
+    std::uniform_int_distribution<size_t> pick(0, sizeof(words) / sizeof(words[0]) - 1);
+
+    std::string prompt;
+    prompt.reserve((size_t) n_tokens * 6);
+    for (int i = 0; i < n_tokens; ++i) {
+        prompt += words[pick(rng)];
+        prompt += ' ';
+    }
+    return prompt;
+}
+
+static void bench_client(llama_server_context &llama, const bench_params &bp, bench_stats &stats,
+                         int n_requests, uint32_t seed) {
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<float> coin(0.0f, 1.0f);
+    std::string prev_prompt;
+
+    for (int r = 0; r < n_requests; ++r) {
+        std::string prompt;
+        if (!prev_prompt.empty() && coin(rng) < bp.cache_hit_ratio) {
+            prompt = prev_prompt; // exercise the prompt cache
+        } else {
+            prompt = synthetic_prompt(rng, bp.n_prompt_tokens);
+            prev_prompt = prompt;
+        }
+
+        json data = {
+            {"prompt",       prompt},
+            {"n_predict",    bp.n_gen_tokens},
+            {"stream",       true},
+            {"cache_prompt", true},
+            {"temperature",  0.0},
+        };
+
+        const int task_id = llama.queue_tasks.get_new_id();
+        llama.queue_results.add_waiting_task_id(task_id);
+        llama.request_completion(task_id, std::move(data), false, false, -1);
+
+        const int64_t t_start = ggml_time_us();
+        int64_t t_prev  = 0;
+        bool    first   = true;
+
+        while (true) {
+            task_result result = llama.queue_results.recv(task_id);
+            const int64_t t_now = ggml_time_us();
+
+            if (result.error) {
+                fprintf(stderr, "request failed: %s\n", result.result_json.dump().c_str());
+                break;
+            }
+
+            if (first) {
+                std::lock_guard<std::mutex> lock(stats.mutex);
+                stats.ttft_ms.push_back((t_now - t_start) / 1e3);
+                first = false;
+            } else {
+                std::lock_guard<std::mutex> lock(stats.mutex);
+                stats.inter_token_ms.push_back((t_now - t_prev) / 1e3);
+            }
+            t_prev = t_now;
+
+            if (result.stop) {
+                if (result.result_json.contains("timings")) {
+                    const json &t = result.result_json["timings"];
+                    std::lock_guard<std::mutex> lock(stats.mutex);
+                    stats.prompt_tokens += json_value(t, "prompt_n", 0.0);
+                    stats.prompt_ms     += json_value(t, "prompt_ms", 0.0);
+                    stats.gen_tokens    += json_value(t, "predicted_n", 0.0);
+                    stats.gen_ms        += json_value(t, "predicted_ms", 0.0);
+                }
+                break;
+            }
+        }
+
+        llama.queue_results.remove_waiting_task_id(task_id);
+    }
+}
+
+int main(int argc, char **argv) {
+    bench_params bp;
+
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        auto next = [&]() -> const char * {
+            if (++i >= argc) {
+                fprintf(stderr, "missing value for %s\n", arg.c_str());
+                exit(1);
+            }
+            return argv[i];
+        };
+
+        if (arg == "-m" || arg == "--model") {
+            bp.model = next();
+        } else if (arg == "-np" || arg == "--parallel") {
+            bp.n_slots = std::stoi(next());
+        } else if (arg == "-r" || arg == "--requests") {
+            bp.n_requests = std::stoi(next());
+        } else if (arg == "--prompt-tokens") {
+            bp.n_prompt_tokens = std::stoi(next());
+        } else if (arg == "--gen-tokens") {
+            bp.n_gen_tokens = std::stoi(next());
+        } else if (arg == "--cache-hit-ratio") {
+            bp.cache_hit_ratio = std::stof(next());
+        } else if (arg == "-c" || arg == "--ctx-size") {
+            bp.n_ctx = std::stoi(next());
+        } else if (arg == "-ngl" || arg == "--n-gpu-layers") {
+            bp.n_gpu_layers = std::stoi(next());
+        } else if (arg == "-s" || arg == "--seed") {
+            bp.seed = (uint32_t) std::stoul(next());
+        } else {
+            fprintf(stderr, "usage: %s -m MODEL [-np N] [-r N] [--prompt-tokens N] [--gen-tokens N]\n"
+                            "          [--cache-hit-ratio F] [-c N] [-ngl N] [-s SEED]\n", argv[0]);
+            return arg == "-h" || arg == "--help" ? 0 : 1;
+        }
+    }
+
+    if (bp.model.empty()) {
+        fprintf(stderr, "no model given (-m)\n");
+        return 1;
+    }
+
+    server_verbose  = false;
+    server_log_json = false;
+
+    gpt_params params;
+    params.model         = bp.model;
+    params.n_parallel    = bp.n_slots;
+    params.n_gpu_layers  = bp.n_gpu_layers;
+    params.cont_batching = true;
+    params.n_ctx         = bp.n_ctx > 0
+        ? bp.n_ctx
+        : bp.n_slots * 2 * (bp.n_prompt_tokens + bp.n_gen_tokens);
+
+    llama_backend_init();
+    llama_numa_init(params.numa);
+
+    llama_server_context llama;
+    if (!llama.load_model(params)) {
+        return 1;
+    }
+    llama.initialize();
+
+    llama.queue_tasks.on_new_task(std::bind(
+        &llama_server_context::process_single_task, &llama, std::placeholders::_1));
+    llama.queue_tasks.on_finish_multitask(std::bind(
+        &llama_server_context::on_finish_multitask, &llama, std::placeholders::_1));
+    llama.queue_tasks.on_run_slots(std::bind(
+        &llama_server_context::update_slots, &llama));
+    llama.queue_results.on_multitask_update(std::bind(
+        &llama_server_queue::update_multitask,
+        &llama.queue_tasks,
+        std::placeholders::_1,
+        std::placeholders::_2,
+        std::placeholders::_3
+    ));
+
+    bench_stats stats;
+    const int64_t t_bench_start = ggml_time_us();
+
+    // one client per slot, requests split between them
+    std::vector<std::thread> clients;
+    int remaining = bp.n_requests;
+    for (int c = 0; c < bp.n_slots; ++c) {
+        const int n = remaining / (bp.n_slots - c);
+        remaining -= n;
+        if (n > 0) {
+            clients.emplace_back(bench_client, std::ref(llama), std::cref(bp), std::ref(stats),
+                                 n, bp.seed + (uint32_t) c);
+        }
+    }
+
+    std::thread terminator([&]() {
+        for (std::thread &c : clients) {
+            c.join();
+        }
+        llama.queue_tasks.terminate();
+    });
+
+    llama.queue_tasks.start_loop();
+    terminator.join();
+
+    const double wall_s = (ggml_time_us() - t_bench_start) / 1e6;
+
+    printf("\n");
+    printf("model:            %s\n", bp.model.c_str());
+    printf("slots:            %d  requests: %d  prompt: ~%d tok  gen: %d tok  cache-hit: %.2f\n",
+           bp.n_slots, bp.n_requests, bp.n_prompt_tokens, bp.n_gen_tokens, bp.cache_hit_ratio);
+    printf("wall time:        %.2f s  (%.2f req/s)\n", wall_s, bp.n_requests / wall_s);
+    printf("prefill:          %.1f tok/s  (%.0f tokens in %.0f ms)\n",
+           stats.prompt_ms > 0 ? 1e3 * stats.prompt_tokens / stats.prompt_ms : 0.0,
+           stats.prompt_tokens, stats.prompt_ms);
+    printf("decode:           %.1f tok/s  (%.0f tokens in %.0f ms)\n",
+           stats.gen_ms > 0 ? 1e3 * stats.gen_tokens / stats.gen_ms : 0.0,
+           stats.gen_tokens, stats.gen_ms);
+    printf("ttft ms:          p50 %.1f  p90 %.1f  p99 %.1f\n",
+           percentile(stats.ttft_ms, 0.50), percentile(stats.ttft_ms, 0.90), percentile(stats.ttft_ms, 0.99));
+    printf("inter-token ms:   p50 %.1f  p90 %.1f  p99 %.1f\n",
+           percentile(stats.inter_token_ms, 0.50), percentile(stats.inter_token_ms, 0.90), percentile(stats.inter_token_ms, 0.99));
+
+    llama_backend_free();
+    return 0;
+}
@@ -43,7 +43,24 @@
 #include <windows.h>
 #endif
 
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif
+
+#include <algorithm>
 #include <cstddef>
+#include <cstring>
+#include <limits>
 #include <thread>
 #include <chrono>
 #include <condition_variable>
@@ -63,16 +80,12 @@ struct server_params {
     bool slots_endpoint = true;
     bool metrics_endpoint = false;
     int n_threads_http = -1;
+    int32_t sse_port = 0; // epoll-based streaming front end (0 = disabled)
 };
 
 bool server_verbose = false;
 bool server_log_json = true;
 
-enum stop_type {
-    STOP_FULL,
-    STOP_PARTIAL,
-};
-
 // TODO: can become bool if we can't find use of more states
 enum slot_state {
     IDLE,
@@ -89,6 +102,11 @@ struct slot_params {
     bool stream       = true;
     bool cache_prompt = false; // remember the prompt to avoid reprocessing all prompt
 
+    // SSE coalescing: flush a streamed chunk every N tokens or after T ms,
+    // whichever comes first (1/0 = one chunk per token, the old behavior)
+    int32_t stream_batch_tokens = 1;
+    int32_t stream_batch_ms     = 0;
+
     uint32_t seed      = -1; // RNG seed
     int32_t  n_keep    =  0; // number of tokens to keep from initial prompt
     int32_t  n_predict = -1; // new tokens to predict
@@ -99,6 +117,95 @@ struct slot_params {
     json input_suffix;
 };
 
+// tokenizations of recently seen prompt chunks, keyed by a hash of the text.
+// chat clients resend the whole conversation each turn, so the returning
+// prefix tokenizes from cache and flows straight into the common_part()
+// n_past reuse. whole chunks only - tokenizing just a suffix is unsafe at
+// BPE merge boundaries. shared between the inference and HTTP threads
+struct tokenize_cache {
+    struct entry {
+        std::string text;
+        std::vector<llama_token> tokens;
+        int64_t t_last_used = 0;
+    };
+
+    size_t max_entries = 64;
+
+    std::mutex mutex;
+    std::unordered_map<uint64_t, entry> entries;
+
+    static uint64_t text_hash(const std::string & text, bool add_bos, bool special) {
+        // FNV-1a over the text and the tokenizer flags
+        uint64_t hash = 0xcbf29ce484222325ULL;
+        for (const char c : text) {
+            hash ^= (uint8_t) c;
+            hash *= 0x100000001b3ULL;
+        }
+        hash ^= (uint8_t) add_bos;
+        hash *= 0x100000001b3ULL;
+        hash ^= (uint8_t) special;
+        hash *= 0x100000001b3ULL;
+        return hash;
+    }
+
+    bool get(uint64_t hash, const std::string & text, std::vector<llama_token> & tokens) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = entries.find(hash);
+        if (it == entries.end() || it->second.text != text) {
+            return false;
+        }
+        it->second.t_last_used = ggml_time_us();
+        tokens = it->second.tokens;
+        return true;
+    }
+
+    void put(uint64_t hash, const std::string & text, const std::vector<llama_token> & tokens) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (entries.count(hash) != 0) {
+            return;
+        }
+
+        // evict the least recently used tokenization beyond the cap
+        while (entries.size() >= max_entries) {
+            auto lru = entries.begin();
+            for (auto it = entries.begin(); it != entries.end(); ++it) {
+                if (it->second.t_last_used < lru->second.t_last_used) {
+                    lru = it;
+                }
+            }
+            entries.erase(lru);
+        }
+
+        entry & ent = entries[hash];
+        ent.text        = text;
+        ent.tokens      = tokens;
+        ent.t_last_used = ggml_time_us();
+    }
+};
+
+// a CLIP encode handed off to the background worker. the job owns the pixel
+// data and, until it is claimed, the resulting embedding, so a cancelled
+// request leaks nothing
+struct image_encode_job {
+    clip_image_u8 * img_data = nullptr;
+
+    float * embedding = nullptr;
+    int32_t n_tokens  = 0;
+
+    bool done    = false; // guarded by the worker mutex
+    bool ok      = false;
+    bool claimed = false;
+
+    ~image_encode_job() {
+        if (!claimed) {
+            free(embedding);
+        }
+        if (img_data) {
+            clip_image_u8_free(img_data);
+        }
+    }
+};
+
 struct slot_image {
     int32_t id;
 
@@ -108,6 +215,9 @@ struct slot_image {
 
     clip_image_u8 * img_data;
 
+    uint64_t content_hash = 0; // hash of the original image bytes
+    std::shared_ptr<image_encode_job> encode_job;
+
     std::string prefix_prompt; // before of this image
 };
 
@@ -142,6 +252,7 @@ struct server_slot {
 
     bool infill = false;
     bool embedding = false;
+    bool prefilling = false; // prompt ingestion is split across scheduling rounds
     bool has_next_token = true;
     bool truncated = false;
     bool stopped_eos = false;
@@ -149,6 +260,22 @@ struct server_slot {
     bool stopped_limit = false;
 
     std::string stopping_word;
+    stop_string_matcher stop_matcher;
+    utf8_stream_state utf8_state;
+
+    // text held back for SSE coalescing, flushed by flush_partial_response
+    std::string coalesced_text;
+    int32_t n_coalesced_tokens = 0;
+    int64_t t_coalesce_start   = 0;
+
+    // priority class of the running task, and a copy of its request so a
+    // preempted generation can be re-queued and resumed
+    int priority = 0;
+    json request_data;
+
+    // bytes of generated_text carried over from before a preemption -
+    // already part of the prompt, not produced by this launch
+    size_t n_resume_prefix = 0;
 
     // sampling
     struct llama_sampling_params sparams;
@@ -170,6 +297,9 @@ struct server_slot {
     int64_t t_start_process_prompt;
     int64_t t_start_genereration;
 
+    int64_t t_queued     = 0; // when the request entered the task queue
+    int64_t t_last_token = 0; // when the previous token was produced
+
     double t_prompt_processing; // ms
     double t_token_generation; // ms
 
@@ -184,10 +314,21 @@ struct server_slot {
         stopped_word           = false;
         stopped_limit          = false;
         stopping_word          = "";
+        stop_matcher.reset();
+        utf8_state.reset();
+        coalesced_text.clear();
+        n_coalesced_tokens     = 0;
+        t_coalesce_start       = 0;
+        priority               = 0;
+        request_data           = json();
+        n_resume_prefix        = 0;
         n_past                 = 0;
         n_sent_text            = 0;
         n_sent_token_probs     = 0;
         infill                 = false;
+        prefilling             = false;
+        t_queued               = 0;
+        t_last_token           = 0;
         ga_i                   = 0;
         n_past_se              = 0;
 
@@ -300,21 +441,111 @@ struct server_slot {
     }
 };
 
+// cheap per-slot state published for the HTTP threads, see
+// publish_slots_snapshot() / read_slots_snapshot()
+struct slot_snapshot {
+    int id      = -1;
+    int task_id = -1;
+
+    slot_state state = IDLE;
+
+    int32_t n_ctx       = 0;
+    int32_t n_past      = 0;
+    int32_t n_decoded   = 0;
+    int32_t n_remaining = -1;
+
+    double t_prompt_processing = 0;
+    double t_token_generation  = 0;
+
+    json to_json() const {
+        return json {
+            {"id",      id},
+            {"task_id", task_id},
+            {"state",   state},
+            {"n_ctx",   n_ctx},
+            {"n_past",  n_past},
+            {"next_token", {
+                {"n_remain",             n_remaining},
+                {"num_tokens_predicted", n_decoded},
+            }},
+            {"t_prompt_processing", t_prompt_processing},
+            {"t_token_generation",  t_token_generation},
+        };
+    }
+};
+
+// fixed-bucket latency histogram. observe() is a few relaxed atomic
+// increments, so the inference thread never takes a lock; the /metrics
+// handler reads the counters directly and renders Prometheus exposition
+// format (bucket bounds in seconds)
+struct latency_histogram {
+    static const std::vector<double> & bounds_ms() {
+        // roughly log-spaced; everything above the last bound lands in +Inf
+        static const std::vector<double> bounds = {
+            1, 2, 5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000,
+        };
+        return bounds;
+    }
+
+    std::atomic<uint64_t> counts[14] = {}; // bounds_ms().size() + 1 for +Inf
+    std::atomic<uint64_t> count{0};
+    std::atomic<uint64_t> sum_us{0};
+
+    void observe(double ms) {
+        const std::vector<double> & bounds = bounds_ms();
+        size_t i = 0;
+        while (i < bounds.size() && ms > bounds[i]) {
+            i++;
+        }
+        counts[i].fetch_add(1, std::memory_order_relaxed);
+        count.fetch_add(1, std::memory_order_relaxed);
+        sum_us.fetch_add((uint64_t) (ms * 1e3), std::memory_order_relaxed);
+    }
+
+    void emit(std::stringstream & prometheus, const std::string & name, const std::string & help) const {
+        prometheus << "# HELP llamacpp:" << name << " " << help << "\n"
+                   << "# TYPE llamacpp:" << name << " histogram\n";
+
+        const std::vector<double> & bounds = bounds_ms();
+        uint64_t cumulative = 0;
+        for (size_t i = 0; i < bounds.size(); i++) {
+            cumulative += counts[i].load(std::memory_order_relaxed);
+            prometheus << "llamacpp:" << name << "_bucket{le=\"" << bounds[i] / 1e3 << "\"} " << cumulative << "\n";
+        }
+        prometheus << "llamacpp:" << name << "_bucket{le=\"+Inf\"} " << count.load(std::memory_order_relaxed) << "\n"
+                   << "llamacpp:" << name << "_sum " << sum_us.load(std::memory_order_relaxed) / 1e6 << "\n"
+                   << "llamacpp:" << name << "_count " << count.load(std::memory_order_relaxed) << "\n";
+    }
+};
+
 struct server_metrics {
     uint64_t n_prompt_tokens_processed_total = 0;
     uint64_t n_tokens_predicted_total        = 0;
 
+    uint64_t n_kv_session_hits   = 0;
+    uint64_t n_kv_session_misses = 0;
+
+    uint64_t n_grammar_cache_hits   = 0;
+    uint64_t n_grammar_cache_misses = 0;
+
     uint64_t n_prompt_tokens_processed = 0;
     uint64_t t_prompt_processing       = 0;
 
     uint64_t n_tokens_predicted       = 0;
     uint64_t t_tokens_generation      = 0;
 
+    // latency distributions, never reset with the bucket
+    latency_histogram prompt_processing_hist;
+    latency_histogram inter_token_hist;
+    latency_histogram queue_wait_hist;
+    latency_histogram first_token_hist;
 
     void on_prompt_eval(const server_slot &slot) {
         n_prompt_tokens_processed_total += slot.n_prompt_tokens_processed;
         n_prompt_tokens_processed       += slot.n_prompt_tokens_processed;
         t_prompt_processing             += slot.t_prompt_processing;
+
+        prompt_processing_hist.observe(slot.t_prompt_processing);
     }
 
     void on_prediction(const server_slot &slot) {
@@ -331,177 +562,813 @@ struct server_metrics {
     }
 };
 
-struct llama_server_context
-{
-    llama_model *model = nullptr;
-    llama_context *ctx = nullptr;
+// persists the KV state of released slots to disk so that a returning
+// conversation can be restored from the page cache instead of re-prefilled
+struct llama_kv_session_store {
+    struct kv_session {
+        std::string path;
+        std::vector<llama_token> tokens;
+        uint64_t system_hash = 0;
+        int64_t  t_last_used = 0;
+    };
 
-    clip_ctx *clp_ctx = nullptr;
+    std::string dir;
+    size_t max_sessions = 64;
 
-    gpt_params params;
+    std::unordered_map<uint64_t, kv_session> sessions;
 
-    llama_batch batch;
+    bool enabled() const {
+        return !dir.empty();
+    }
 
-    bool multimodal         = false;
-    bool clean_kv_cache     = true;
-    bool all_slots_are_idle = false;
-    bool add_bos_token      = true;
+    static uint64_t token_hash(const std::vector<llama_token> & tokens, size_t n, uint64_t hash = 0xcbf29ce484222325ULL) {
+        // FNV-1a over the raw token IDs, chainable via the seed
+        n = std::min(n, tokens.size());
+        for (size_t j = 0; j < n; j++) {
+            const llama_token tok = tokens[j];
+            for (size_t i = 0; i < sizeof(tok); i++) {
+                hash ^= (uint8_t) (tok >> (8*i));
+                hash *= 0x100000001b3ULL;
+            }
+        }
+        return hash;
+    }
 
-    int32_t n_ctx;  // total context for all clients / slots
+    std::string session_path(uint64_t hash) const {
+        char name[32];
+        snprintf(name, sizeof(name), "kv-%016llx.bin", (unsigned long long) hash);
+        return dir + "/" + name;
+    }
 
-    // system prompt
-    bool system_need_update = false;
+    // persist the first `n_tokens` of `tokens` (only those have KV cells)
+    void save(llama_context *ctx, int seq_id, const std::vector<llama_token> & tokens, size_t n_tokens, const std::vector<llama_token> & system_tokens) {
+        n_tokens = std::min(n_tokens, tokens.size());
+        if (n_tokens == 0) {
+            return;
+        }
 
-    std::string              system_prompt;
-    std::vector<llama_token> system_tokens;
+        // sessions saved under different system prompts hold incompatible
+        // positions even when the conversation tokens match, so the system
+        // prompt content participates in the key
+        const uint64_t system_hash = token_hash(system_tokens, system_tokens.size());
+        const uint64_t hash        = token_hash(tokens, n_tokens, system_hash);
 
-    std::string name_user;      // this should be the antiprompt
-    std::string name_assistant;
+        auto it = sessions.find(hash);
+        if (it != sessions.end()) {
+            // identical token sequence already persisted
+            it->second.t_last_used = ggml_time_us();
+            return;
+        }
 
-    // slots / clients
-    std::vector<server_slot> slots;
-    json default_generation_settings_for_props;
+        const size_t state_size = llama_state_seq_get_size(ctx, seq_id);
+        if (state_size == 0) {
+            return;
+        }
 
-    llama_server_queue    queue_tasks;
-    llama_server_response queue_results;
+        std::vector<uint8_t> state(state_size);
+        if (llama_state_seq_get_data(ctx, state.data(), seq_id) != state_size) {
+            LOG_WARNING("failed to serialize KV sequence state", {{"seq_id", seq_id}});
+            return;
+        }
 
-    server_metrics metrics;
+        kv_session session;
+        session.path        = session_path(hash);
+        session.tokens.assign(tokens.begin(), tokens.begin() + n_tokens);
+        session.system_hash = system_hash;
+        session.t_last_used = ggml_time_us();
 
-    ~llama_server_context()
-    {
-        if (clp_ctx)
-        {
-            LOG_INFO("freeing clip model", {});
-            clip_free(clp_ctx);
-            clp_ctx = nullptr;
+        std::ofstream file(session.path, std::ios::binary | std::ios::trunc);
+        if (!file) {
+            LOG_WARNING("failed to open KV session file for writing", {{"path", session.path}});
+            return;
         }
-        if (ctx)
-        {
-            llama_free(ctx);
-            ctx = nullptr;
+
+        const uint32_t n_saved = n_tokens;
+        file.write((const char *) &system_hash, sizeof(system_hash));
+        file.write((const char *) &n_saved, sizeof(n_saved));
+        file.write((const char *) session.tokens.data(), n_saved * sizeof(llama_token));
+        file.write((const char *) state.data(), state.size());
+        if (!file) {
+            LOG_WARNING("failed to write KV session file", {{"path", session.path}});
+            return;
         }
-        if (model)
-        {
-            llama_free_model(model);
-            model = nullptr;
+
+        sessions.emplace(hash, std::move(session));
+
+        // evict the least recently used session beyond the cap
+        while (sessions.size() > max_sessions) {
+            auto lru = sessions.begin();
+            for (auto it = sessions.begin(); it != sessions.end(); ++it) {
+                if (it->second.t_last_used < lru->second.t_last_used) {
+                    lru = it;
+                }
+            }
+            std::remove(lru->second.path.c_str());
+            sessions.erase(lru);
         }
     }
 
-    bool load_model(const gpt_params &params_)
-    {
-        params = params_;
-        if (!params.mmproj.empty()) {
-            multimodal = true;
-            LOG_INFO("Multi Modal Mode Enabled", {});
-            clp_ctx = clip_model_load(params.mmproj.c_str(), /*verbosity=*/ 1);
-            if(clp_ctx == nullptr) {
-                LOG_ERROR("unable to load clip model", {{"model", params.mmproj}});
-                return false;
-            }
+    // restore the persisted session sharing the longest prefix with `prompt_tokens`
+    // into sequence `seq_id`. returns the number of prompt tokens restored
+    size_t restore(llama_context *ctx, int seq_id, const std::vector<llama_token> & prompt_tokens, const std::vector<llama_token> & system_tokens, size_t n_past) {
+        const uint64_t system_hash = token_hash(system_tokens, system_tokens.size());
 
-            if (params.n_ctx < 2048) { // request larger context for the image embedding
-                params.n_ctx = 2048;
+        uint64_t best_hash  = 0;
+        size_t best_common  = n_past;
+        bool   found        = false;
+
+        for (const auto & el : sessions) {
+            if (el.second.system_hash != system_hash) {
+                continue; // saved under a different system prompt, positions won't line up
+            }
+            const size_t common = common_part(el.second.tokens, prompt_tokens);
+            if (common > best_common) {
+                best_common = common;
+                best_hash   = el.first;
+                found       = true;
             }
         }
 
-        std::tie(model, ctx) = llama_init_from_gpt_params(params);
-        if (model == nullptr)
-        {
-            LOG_ERROR("unable to load model", {{"model", params.model}});
-            return false;
+        if (!found) {
+            return 0;
         }
 
-        if (multimodal) {
-            const int n_embd_clip = clip_n_mmproj_embd(clp_ctx);
-            const int n_embd_llm  = llama_n_embd(model);
-            if (n_embd_clip != n_embd_llm) {
-                LOG_TEE("%s: embedding dim of the multimodal projector (%d) is not equal to that of LLaMA (%d). Make sure that you use the correct mmproj file.\n", __func__, n_embd_clip, n_embd_llm);
-                llama_free(ctx);
-                llama_free_model(model);
-                return false;
-            }
+        kv_session & session = sessions.at(best_hash);
+
+        std::ifstream file(session.path, std::ios::binary);
+        if (!file) {
+            sessions.erase(best_hash);
+            return 0;
         }
 
-        n_ctx = llama_n_ctx(ctx);
+        uint64_t file_system_hash = 0;
+        uint32_t n_tokens = 0;
+        file.read((char *) &file_system_hash, sizeof(file_system_hash));
+        file.read((char *) &n_tokens, sizeof(n_tokens));
+        file.seekg(n_tokens * sizeof(llama_token), std::ios::cur);
+
+        std::vector<uint8_t> state(
+            std::istreambuf_iterator<char>(file),
+            std::istreambuf_iterator<char>());
+        if (state.empty()) {
+            sessions.erase(best_hash);
+            return 0;
+        }
 
-        add_bos_token = llama_should_add_bos_token(model);
+        // the sequence may hold stale data (including its copy of the system
+        // prompt, which the restored state brings back) - drop it entirely
+        llama_kv_cache_seq_rm(ctx, seq_id, 0, -1);
 
-        return true;
-    }
+        if (llama_state_seq_set_data(ctx, state.data(), seq_id) == 0) {
+            LOG_WARNING("failed to restore KV sequence state", {{"path", session.path}});
+            llama_kv_cache_seq_rm(ctx, seq_id, 0, -1);
+            sessions.erase(best_hash);
+            return 0;
+        }
 
-    void validate_model_chat_template(server_params & sparams) {
-        llama_chat_message chat[] = {{"user", "test"}};
-        std::vector<char> buf(1);
-        int res = llama_chat_apply_template(model, nullptr, chat, 1, true, buf.data(), buf.size());
-        if (res < 0) {
-            LOG_ERROR("The chat template comes with this model is not yet supported, falling back to chatml. This may cause the model to output suboptimal responses", {});
-            sparams.chat_template = "chatml";
+        // the last prompt token must be re-evaluated to produce logits
+        if (best_common >= prompt_tokens.size()) {
+            best_common = prompt_tokens.size() - 1;
         }
+
+        // trim whatever the session holds beyond the shared prefix
+        llama_kv_cache_seq_rm(ctx, seq_id, system_tokens.size() + best_common, -1);
+
+        session.t_last_used = ggml_time_us();
+
+        return best_common;
     }
+};
 
-    void initialize() {
-        // create slots
-        all_slots_are_idle = true;
+// cache of parsed grammars keyed by a hash of the grammar text, so requests
+// repeating the same grammar skip the parse in llama_sampling_init
+struct llama_grammar_cache {
+    struct entry {
+        std::string                 text;
+        grammar_parser::parse_state parsed;
+        int64_t                     t_last_used = 0;
+    };
 
-        const int32_t n_ctx_slot = n_ctx / params.n_parallel;
+    size_t max_entries = 16;
 
-        LOG_INFO("initializing slots", {{"n_slots", params.n_parallel}});
-        for (int i = 0; i < params.n_parallel; i++)
-        {
-            server_slot slot;
+    std::unordered_map<uint64_t, entry> entries;
 
-            slot.id = i;
-            slot.n_ctx = n_ctx_slot;
-            slot.n_predict = params.n_predict;
+    static uint64_t text_hash(const std::string & text) {
+        // FNV-1a over the grammar bytes
+        uint64_t hash = 0xcbf29ce484222325ULL;
+        for (const char c : text) {
+            hash ^= (uint8_t) c;
+            hash *= 0x100000001b3ULL;
+        }
+        return hash;
+    }
 
-            LOG_INFO("new slot", {
-                {"slot_id",    slot.id},
-                {"n_ctx_slot", slot.n_ctx}
-            });
+    // returns the parsed grammar, parsing and inserting on a miss.
+    // returns nullptr when the text does not parse - the caller falls back
+    // to the regular llama_sampling_init path
+    const grammar_parser::parse_state * get(const std::string & text, bool & hit) {
+        const uint64_t hash = text_hash(text);
+
+        auto it = entries.find(hash);
+        if (it != entries.end() && it->second.text == text) {
+            hit = true;
+            it->second.t_last_used = ggml_time_us();
+            return &it->second.parsed;
+        }
 
-            const int ga_n = params.grp_attn_n;
-            const int ga_w = params.grp_attn_w;
+        hit = false;
 
-            if (ga_n != 1) {
-                GGML_ASSERT(ga_n > 0                    && "ga_n must be positive");                       // NOLINT
-                GGML_ASSERT(ga_w % ga_n == 0            && "ga_w must be a multiple of ga_n");             // NOLINT
-                //GGML_ASSERT(n_ctx_train % ga_w == 0     && "n_ctx_train must be a multiple of ga_w");    // NOLINT
-                //GGML_ASSERT(n_ctx >= n_ctx_train * ga_n && "n_ctx must be at least n_ctx_train * ga_n"); // NOLINT
+        grammar_parser::parse_state parsed = grammar_parser::parse(text.c_str());
+        if (parsed.rules.empty()) {
+            return nullptr;
+        }
 
-                LOG_INFO("slot self-extend", {
-                    {"slot_id",   slot.id},
-                    {"ga_n",      ga_n},
-                    {"ga_w",      ga_w}
-                });
+        // evict the least recently used grammar beyond the cap
+        while (entries.size() >= max_entries) {
+            auto lru = entries.begin();
+            for (auto el = entries.begin(); el != entries.end(); ++el) {
+                if (el->second.t_last_used < lru->second.t_last_used) {
+                    lru = el;
+                }
             }
+            entries.erase(lru);
+        }
 
-            slot.ga_i = 0;
-            slot.ga_n = ga_n;
-            slot.ga_w = ga_w;
+        entry & ent = entries[hash];
+        ent.text        = text;
+        ent.parsed      = std::move(parsed);
+        ent.t_last_used = ggml_time_us();
 
-            slot.reset();
+        return &ent.parsed;
+    }
+};
 
-            slots.push_back(slot);
+// embeddings of recently encoded images, keyed by a hash of the image bytes.
+// bounded by the total embedding bytes held, evicting least recently used
+// (inference thread only)
+struct image_embedding_cache {
+    struct entry {
+        std::vector<float> embedding;
+        int32_t n_tokens    = 0;
+        int64_t t_last_used = 0;
+    };
+
+    size_t max_bytes = 128ull * 1024 * 1024;
+    size_t cur_bytes = 0;
+
+    std::unordered_map<uint64_t, entry> entries;
+
+    static uint64_t bytes_hash(const std::vector<uint8_t> & bytes) {
+        // FNV-1a over the image bytes
+        uint64_t hash = 0xcbf29ce484222325ULL;
+        for (const uint8_t b : bytes) {
+            hash ^= b;
+            hash *= 0x100000001b3ULL;
         }
+        return hash;
+    }
 
-        default_generation_settings_for_props = get_formated_generation(slots.front());
-        default_generation_settings_for_props["seed"] = -1;
+    const entry * get(uint64_t hash) {
+        auto it = entries.find(hash);
+        if (it == entries.end()) {
+            return nullptr;
+        }
+        it->second.t_last_used = ggml_time_us();
+        return &it->second;
+    }
 
-        batch = llama_batch_init(n_ctx, 0, params.n_parallel);
+    void put(uint64_t hash, const float * embedding, int32_t n_tokens, int n_embd) {
+        if (entries.count(hash) != 0) {
+            return;
+        }
+
+        const size_t n_bytes = (size_t) n_tokens * n_embd * sizeof(float);
+        if (n_bytes > max_bytes) {
+            return;
+        }
+
+        entry ent;
+        ent.embedding.assign(embedding, embedding + (size_t) n_tokens * n_embd);
+        ent.n_tokens    = n_tokens;
+        ent.t_last_used = ggml_time_us();
+
+        cur_bytes += n_bytes;
+        entries.emplace(hash, std::move(ent));
+
+        // evict the least recently used embeddings beyond the byte budget
+        while (cur_bytes > max_bytes && entries.size() > 1) {
+            auto lru = entries.begin();
+            for (auto it = entries.begin(); it != entries.end(); ++it) {
+                if (it->second.t_last_used < lru->second.t_last_used) {
+                    lru = it;
+                }
+            }
+            cur_bytes -= lru->second.embedding.size() * sizeof(float);
+            entries.erase(lru);
+        }
     }
+};
 
-    std::vector<llama_token> tokenize(const json & json_prompt, bool add_bos) const
+// warm the model file's page cache with several threads doing sequential reads,
+// so llama.cpp's first-touch mmap faults hit RAM instead of disk - a single
+// faulting thread cannot reach full NVMe bandwidth, parallel readers can
+static void prefault_model_file(const std::string &fname, int n_threads)
+{
+#if defined(__unix__) || defined(__APPLE__)
+    const int fd = open(fname.c_str(), O_RDONLY);
+    if (fd < 0)
     {
-        // TODO: currently, we tokenize using special tokens by default
-        //       this is not always correct (see https://github.com/ggerganov/llama.cpp/pull/4160#issuecomment-1824826216)
-        //       but it's better compared to completely ignoring ChatML and other chat templates
-        const bool TMP_FORCE_SPECIAL = true;
-
-        // If `add_bos` is true, we only add BOS, when json_prompt is a string,
-        // or the first element of the json_prompt array is a string.
-        std::vector<llama_token> prompt_tokens;
+        LOG_WARNING("prefault: unable to open model file", {{"model", fname}});
+        return;
+    }
 
-        if (json_prompt.is_array())
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        close(fd);
+        return;
+    }
+
+    const size_t file_size  = (size_t) st.st_size;
+    const size_t chunk_size = 1024 * 1024;
+    const size_t n_chunks   = (file_size + chunk_size - 1) / chunk_size;
+
+#if defined(POSIX_FADV_WILLNEED)
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+#endif
+
+    const int64_t t_start = ggml_time_us();
+
+    std::atomic<size_t> next_chunk(0);
+    std::atomic<size_t> n_bytes_read(0);
+
+    std::vector<std::thread> workers;
+    for (int t = 0; t < std::max(n_threads, 1); ++t)
+    {
+        workers.emplace_back([&]() {
+            std::vector<char> buf(chunk_size);
+            for (size_t i = next_chunk.fetch_add(1); i < n_chunks; i = next_chunk.fetch_add(1))
+            {
+                const size_t offset = i * chunk_size;
+                const ssize_t n = pread(fd, buf.data(), std::min(chunk_size, file_size - offset), (off_t) offset);
+                if (n > 0)
+                {
+                    n_bytes_read.fetch_add((size_t) n, std::memory_order_relaxed);
+                }
+            }
+        });
+    }
+
+    for (std::thread &w : workers)
+    {
+        w.join();
+    }
+
+    close(fd);
+
+    LOG_INFO("model file prefaulted", {
+        {"model",     fname},
+        {"n_threads", n_threads},
+        {"n_mib",     n_bytes_read.load() / (1024 * 1024)},
+        {"t_ms",      (ggml_time_us() - t_start) / 1000},
+    });
+#else
+    (void) fname;
+    (void) n_threads;
+    LOG_WARNING("prefault is not supported on this platform", {});
+#endif
+}
+
+struct llama_server_context
+{
+    llama_model *model = nullptr;
+    llama_context *ctx = nullptr;
+
+    clip_ctx *clp_ctx = nullptr;
+
+    // optional draft model for speculative decoding (--model-draft)
+    llama_model   *model_draft = nullptr;
+    llama_context *ctx_draft   = nullptr;
+
+    // optional dedicated embedding model (--model-embedding) - embedding tasks
+    // are routed to it by the task handler instead of occupying a slot
+    llama_model   *model_embd = nullptr;
+    llama_context *ctx_embd   = nullptr;
+    std::string    model_embd_path;
+
+    gpt_params params;
+
+    llama_batch batch;
+    llama_batch batch_draft;
+
+    // tokens currently decoded in the draft context, mirroring the sequence
+    // of the slot being speculated for
+    std::vector<llama_token> draft_tokens;
+
+    bool multimodal         = false;
+    bool clean_kv_cache     = true;
+    bool all_slots_are_idle = false;
+    bool add_bos_token      = true;
+
+    int32_t n_ctx;  // total context for all clients / slots
+
+    // max prompt tokens one slot may contribute per scheduling round (0 = unlimited),
+    // so a long prefill is interleaved with the decode steps of running slots
+    int32_t n_prefill_chunk = 0;
+
+    // fraction of the non-pinned window discarded per context shift
+    float ctx_shift_discard = 0.5f;
+
+    // StreamingLLM-style attention sinks: always keep at least this many leading
+    // tokens across context shifts (0 = disabled, n_keep still applies)
+    int32_t n_attention_sinks = 0;
+
+    // threads used to prefault the model file before loading (0 = disabled)
+    int32_t n_prefault_threads = 0;
+
+    // system prompt
+    bool system_need_update = false;
+
+    std::string              system_prompt;
+    std::vector<llama_token> system_tokens;
+
+    // a named system prompt whose KV lives in a dedicated sequence past the
+    // slot ids - decoded once, then shared into the slot sequences with
+    // llama_kv_cache_seq_cp when it is selected
+    struct system_persona {
+        std::string              prompt;
+        std::vector<llama_token> tokens;
+
+        llama_seq_id seq_id  = -1;
+        bool         decoded = false;
+    };
+
+    std::unordered_map<std::string, system_persona> personas;
+    std::string pending_persona; // name of the persona to switch to, empty = unnamed prompt
+
+    // sequences reserved past the slot ids for persona prompts - added to the
+    // parallel-sequence count when the context is created, so a persona decode
+    // never targets a sequence the context does not have
+    static const int32_t n_personas_max = 8;
+
+    std::string name_user;      // this should be the antiprompt
+    std::string name_assistant;
+
+    // slots / clients
+    std::vector<server_slot> slots;
+
+    // task_id -> running slot, so TASK_TYPE_CANCEL is O(1).
+    // only touched from the task-processing thread
+    std::unordered_map<int, server_slot *> task_to_slot;
+    json default_generation_settings_for_props;
+
+    llama_server_queue    queue_tasks;
+    llama_server_response queue_results;
+
+    server_metrics metrics;
+
+    // index of prompt prefixes held in the KV cache of released slots,
+    // used to seed new prompts via llama_kv_cache_seq_cp
+    token_prefix_index prefix_index;
+
+    // on-disk store of per-conversation KV state, enabled with --kv-session-dir
+    llama_kv_session_store kv_sessions;
+
+    // parsed grammars reused across requests (inference thread only)
+    llama_grammar_cache grammars;
+
+    // seqlock-published slot state: the inference thread bumps the version to
+    // odd, rewrites the snapshot, bumps it to even; HTTP threads retry until
+    // they read an even, unchanged version
+    std::atomic<uint64_t> snapshot_version{0};
+    std::vector<slot_snapshot> snapshot_slots;
+
+    // embeddings of previously seen images
+    image_embedding_cache image_cache;
+
+    // tokenizations of previously seen prompt chunks (tokenize() is const)
+    mutable tokenize_cache token_cache;
+
+    // raw image bytes posted to /upload-image, consumed once by an
+    // image_data entry referencing the returned id (shared with the
+    // HTTP threads)
+    struct uploaded_image {
+        std::vector<uint8_t> bytes;
+        int64_t t_uploaded = 0;
+    };
+    std::mutex mutex_uploads;
+    std::unordered_map<std::string, uploaded_image> uploaded_images;
+
+    std::string store_uploaded_image(const std::string & body)
+    {
+        std::string id = random_string();
+
+        uploaded_image upload;
+        upload.bytes.assign(body.begin(), body.end());
+        upload.t_uploaded = ggml_time_us();
+
+        std::lock_guard<std::mutex> lock(mutex_uploads);
+        uploaded_images.emplace(id, std::move(upload));
+
+        // drop the oldest uploads that were never referenced
+        while (uploaded_images.size() > 32) {
+            auto oldest = uploaded_images.begin();
+            for (auto it = uploaded_images.begin(); it != uploaded_images.end(); ++it) {
+                if (it->second.t_uploaded < oldest->second.t_uploaded) {
+                    oldest = it;
+                }
+            }
+            uploaded_images.erase(oldest);
+        }
+
+        return id;
+    }
+
+    bool take_uploaded_image(const std::string & id, std::vector<uint8_t> & bytes)
+    {
+        std::lock_guard<std::mutex> lock(mutex_uploads);
+        auto it = uploaded_images.find(id);
+        if (it == uploaded_images.end()) {
+            return false;
+        }
+        bytes = std::move(it->second.bytes);
+        uploaded_images.erase(it);
+        return true;
+    }
+
+    // background CLIP encode worker - the only user of clp_ctx after startup,
+    // so image encoding overlaps with llama_decode on the inference thread
+    std::thread clip_worker;
+    std::mutex mutex_clip;
+    std::condition_variable condition_clip;
+    std::vector<std::shared_ptr<image_encode_job>> clip_jobs;
+    bool clip_running = false;
+
+    ~llama_server_context()
+    {
+        if (clip_running)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_clip);
+                clip_running = false;
+            }
+            condition_clip.notify_all();
+            clip_worker.join();
+        }
+        if (clp_ctx)
+        {
+            LOG_INFO("freeing clip model", {});
+            clip_free(clp_ctx);
+            clp_ctx = nullptr;
+        }
+        if (ctx_embd)
+        {
+            llama_free(ctx_embd);
+            ctx_embd = nullptr;
+        }
+        if (model_embd)
+        {
+            llama_free_model(model_embd);
+            model_embd = nullptr;
+        }
+        if (ctx_draft)
+        {
+            llama_free(ctx_draft);
+            ctx_draft = nullptr;
+        }
+        if (model_draft)
+        {
+            llama_free_model(model_draft);
+            model_draft = nullptr;
+        }
+        if (ctx)
+        {
+            llama_free(ctx);
+            ctx = nullptr;
+        }
+        if (model)
+        {
+            llama_free_model(model);
+            model = nullptr;
+        }
+    }
+
+    bool load_model(const gpt_params &params_)
+    {
+        params = params_;
+        if (!params.mmproj.empty()) {
+            multimodal = true;
+            LOG_INFO("Multi Modal Mode Enabled", {});
+            clp_ctx = clip_model_load(params.mmproj.c_str(), /*verbosity=*/ 1);
+            if(clp_ctx == nullptr) {
+                LOG_ERROR("unable to load clip model", {{"model", params.mmproj}});
+                return false;
+            }
+
+            if (params.n_ctx < 2048) { // request larger context for the image embedding
+                params.n_ctx = 2048;
+            }
+
+            clip_running = true;
+            clip_worker  = std::thread(&llama_server_context::clip_worker_loop, this);
+        }
+
+        if (n_prefault_threads > 0 && !params.model.empty())
+        {
+            prefault_model_file(params.model, n_prefault_threads);
+        }
+
+        // reserve extra sequences for persona prompts on top of the slots
+        params.n_parallel += n_personas_max;
+        std::tie(model, ctx) = llama_init_from_gpt_params(params);
+        params.n_parallel -= n_personas_max;
+        if (model == nullptr)
+        {
+            LOG_ERROR("unable to load model", {{"model", params.model}});
+            return false;
+        }
+
+        if (multimodal) {
+            const int n_embd_clip = clip_n_mmproj_embd(clp_ctx);
+            const int n_embd_llm  = llama_n_embd(model);
+            if (n_embd_clip != n_embd_llm) {
+                LOG_TEE("%s: embedding dim of the multimodal projector (%d) is not equal to that of LLaMA (%d). Make sure that you use the correct mmproj file.\n", __func__, n_embd_clip, n_embd_llm);
+                llama_free(ctx);
+                llama_free_model(model);
+                return false;
+            }
+        }
+
+        n_ctx = llama_n_ctx(ctx);
+
+        if (!params.model_draft.empty()) {
+            gpt_params params_draft = params;
+            params_draft.model = params.model_draft;
+            params_draft.model_draft.clear();
+            params_draft.mmproj.clear();
+
+            std::tie(model_draft, ctx_draft) = llama_init_from_gpt_params(params_draft);
+            if (model_draft == nullptr)
+            {
+                LOG_ERROR("unable to load draft model", {{"model", params.model_draft}});
+                return false;
+            }
+
+            if (llama_n_vocab(model_draft) != llama_n_vocab(model)) {
+                LOG_ERROR("draft model vocabulary does not match the target model", {
+                    {"model",       params.model},
+                    {"model_draft", params.model_draft},
+                });
+                return false;
+            }
+
+            // verification decodes the drafted tokens plus the sampled one in a
+            // single batch, so the draft length must leave room for that extra
+            // token - otherwise the chunked decode re-evaluates the tail and
+            // corrupts the speculated positions
+            if (params.n_draft > (int32_t) params.n_batch - 1)
+            {
+                LOG_WARNING("clamping n_draft to fit the decode batch", {
+                    {"n_draft", params.n_draft},
+                    {"n_batch", params.n_batch},
+                });
+                params.n_draft = (int32_t) params.n_batch - 1;
+            }
+
+            LOG_INFO("speculative decoding enabled", {
+                {"model_draft", params.model_draft},
+                {"n_draft",     params.n_draft},
+            });
+        }
+
+        if (!model_embd_path.empty()) {
+            gpt_params params_embd = params;
+            params_embd.model = model_embd_path;
+            params_embd.model_draft.clear();
+            params_embd.mmproj.clear();
+            params_embd.embedding  = true;
+            params_embd.n_parallel = 1;
+
+            std::tie(model_embd, ctx_embd) = llama_init_from_gpt_params(params_embd);
+            if (model_embd == nullptr)
+            {
+                LOG_ERROR("unable to load embedding model", {{"model", model_embd_path}});
+                return false;
+            }
+
+            LOG_INFO("dedicated embedding model enabled", {
+                {"model", model_embd_path},
+            });
+        }
+
+        add_bos_token = llama_should_add_bos_token(model);
+
+        return true;
+    }
+
+    void validate_model_chat_template(server_params & sparams) {
+        llama_chat_message chat[] = {{"user", "test"}};
+        std::vector<char> buf(1);
+        int res = llama_chat_apply_template(model, nullptr, chat, 1, true, buf.data(), buf.size());
+        if (res < 0) {
+            LOG_ERROR("The chat template comes with this model is not yet supported, falling back to chatml. This may cause the model to output suboptimal responses", {});
+            sparams.chat_template = "chatml";
+        }
+    }
+
+    void initialize() {
+        // create slots
+        all_slots_are_idle = true;
+
+        const int32_t n_ctx_slot = n_ctx / params.n_parallel;
+
+        LOG_INFO("initializing slots", {{"n_slots", params.n_parallel}});
+        for (int i = 0; i < params.n_parallel; i++)
+        {
+            server_slot slot;
+
+            slot.id = i;
+            slot.n_ctx = n_ctx_slot;
+            slot.n_predict = params.n_predict;
+
+            LOG_INFO("new slot", {
+                {"slot_id",    slot.id},
+                {"n_ctx_slot", slot.n_ctx}
+            });
+
+            const int ga_n = params.grp_attn_n;
+            const int ga_w = params.grp_attn_w;
+
+            if (ga_n != 1) {
+                GGML_ASSERT(ga_n > 0                    && "ga_n must be positive");                       // NOLINT
+                GGML_ASSERT(ga_w % ga_n == 0            && "ga_w must be a multiple of ga_n");             // NOLINT
+                //GGML_ASSERT(n_ctx_train % ga_w == 0     && "n_ctx_train must be a multiple of ga_w");    // NOLINT
+                //GGML_ASSERT(n_ctx >= n_ctx_train * ga_n && "n_ctx must be at least n_ctx_train * ga_n"); // NOLINT
+
+                LOG_INFO("slot self-extend", {
+                    {"slot_id",   slot.id},
+                    {"ga_n",      ga_n},
+                    {"ga_w",      ga_w}
+                });
+            }
+
+            slot.ga_i = 0;
+            slot.ga_n = ga_n;
+            slot.ga_w = ga_w;
+
+            slot.reset();
+
+            slots.push_back(slot);
+        }
+
+        default_generation_settings_for_props = get_formated_generation(slots.front());
+        default_generation_settings_for_props["seed"] = -1;
+
+        batch = llama_batch_init(n_ctx, 0, params.n_parallel);
+
+        if (ctx_draft != nullptr)
+        {
+            batch_draft = llama_batch_init(n_ctx, 0, 1);
+        }
+
+        // make /health and /slots meaningful before the first scheduling round
+        publish_slots_snapshot();
+    }
+
+    // llama_tokenize through the cache - short strings are not worth the
+    // hashing and map churn
+    std::vector<llama_token> tokenize_cached(const std::string & s, bool add_bos, bool special) const
+    {
+        if (s.size() < 64)
+        {
+            return ::llama_tokenize(ctx, s, add_bos, special);
+        }
+
+        const uint64_t hash = tokenize_cache::text_hash(s, add_bos, special);
+
+        std::vector<llama_token> tokens;
+        if (token_cache.get(hash, s, tokens))
+        {
+            return tokens;
+        }
+
+        tokens = ::llama_tokenize(ctx, s, add_bos, special);
+        token_cache.put(hash, s, tokens);
+        return tokens;
+    }
+
+    std::vector<llama_token> tokenize(const json & json_prompt, bool add_bos) const
+    {
+        // TODO: currently, we tokenize using special tokens by default
+        //       this is not always correct (see https://github.com/ggerganov/llama.cpp/pull/4160#issuecomment-1824826216)
+        //       but it's better compared to completely ignoring ChatML and other chat templates
+        const bool TMP_FORCE_SPECIAL = true;
+
+        // If `add_bos` is true, we only add BOS, when json_prompt is a string,
+        // or the first element of the json_prompt array is a string.
+        std::vector<llama_token> prompt_tokens;
+
+        if (json_prompt.is_array())
         {
             bool first = true;
             for (const auto& p : json_prompt)
@@ -512,12 +1379,12 @@ struct llama_server_context
                     std::vector<llama_token> p;
                     if (first)
                     {
-                        p = ::llama_tokenize(ctx, s, add_bos, TMP_FORCE_SPECIAL);
+                        p = tokenize_cached(s, add_bos, TMP_FORCE_SPECIAL);
                         first = false;
                     }
                     else
                     {
-                        p = ::llama_tokenize(ctx, s, false, TMP_FORCE_SPECIAL);
+                        p = tokenize_cached(s, false, TMP_FORCE_SPECIAL);
                     }
                     prompt_tokens.insert(prompt_tokens.end(), p.begin(), p.end());
                 }
@@ -534,16 +1401,29 @@ struct llama_server_context
         else
         {
             auto s = json_prompt.template get<std::string>();
-            prompt_tokens = ::llama_tokenize(ctx, s, add_bos, TMP_FORCE_SPECIAL);
+            prompt_tokens = tokenize_cached(s, add_bos, TMP_FORCE_SPECIAL);
         }
 
         return prompt_tokens;
     }
 
-    server_slot* get_slot(int id) {
+    server_slot* get_slot(int id, const json & data = json()) {
         int64_t t_last = ggml_time_us();
         server_slot *last_used = nullptr;
 
+        // prefix affinity: a returning conversation should land on the slot
+        // that still holds its KV cache, not on whichever slot is coldest.
+        // the raw prompt strings the server already keeps are a cheap proxy
+        // for the token prefix reuse done by common_part() in update_slots
+        std::string prompt;
+        if (data.is_object() && data.contains("prompt") && data.at("prompt").is_string())
+        {
+            prompt = data.at("prompt").get<std::string>();
+        }
+
+        server_slot *best_affinity = nullptr;
+        size_t best_prefix = 0;
+
         for (server_slot & slot : slots)
         {
             if (slot.id == id && slot.available())
@@ -551,23 +1431,62 @@ struct llama_server_context
                 return &slot;
             }
 
-            if (slot.available() && slot.t_last_used < t_last)
+            if (!slot.available())
+            {
+                continue;
+            }
+
+            if (!prompt.empty() && slot.prompt.is_string())
+            {
+                const size_t n = common_part(prompt, slot.prompt.get_ref<const std::string &>());
+                if (n > best_prefix)
+                {
+                    best_prefix   = n;
+                    best_affinity = &slot;
+                }
+            }
+
+            if (slot.t_last_used < t_last)
             {
                 last_used = &slot;
                 t_last = slot.t_last_used;
             }
         }
 
+        // only override LRU when a meaningful part of the prompt is reusable
+        if (best_affinity != nullptr && best_prefix >= prompt.size() / 2)
+        {
+            LOG_VERBOSE("prefix affinity slot", {
+                {"slot_id",  best_affinity->id},
+                {"n_prefix", best_prefix},
+            });
+            return best_affinity;
+        }
+
         return last_used;
     }
 
-    bool launch_slot_with_data(server_slot* &slot, json data) {
+    bool launch_slot_with_data(server_slot* &slot, json data,
+                               std::vector<std::vector<uint8_t>> image_buffers = std::vector<std::vector<uint8_t>>()) {
         slot_params default_params;
         llama_sampling_params default_sparams;
 
+        slot->priority     = json_value(data, "priority", 0);
+        slot->request_data = data; // kept so a preempted task can be re-queued
+
         slot->params.stream             = json_value(data, "stream",            false);
+        slot->params.stream_batch_tokens = json_value(data, "stream_batch_tokens", default_params.stream_batch_tokens);
+        slot->params.stream_batch_ms     = json_value(data, "stream_batch_ms",     default_params.stream_batch_ms);
         slot->params.cache_prompt       = json_value(data, "cache_prompt",      false);
         slot->params.n_predict          = json_value(data, "n_predict",         default_params.n_predict);
+
+        // size the text buffer for the whole generation once (~4 bytes per
+        // token) so per-token appends never reallocate
+        {
+            const int32_t n_expected = slot->params.n_predict > 0 ? slot->params.n_predict : slot->n_ctx;
+            slot->generated_text.reserve(4 * (size_t) std::max(n_expected, (int32_t) 0));
+        }
+
         slot->sparams.top_k             = json_value(data, "top_k",             default_sparams.top_k);
         slot->sparams.top_p             = json_value(data, "top_p",             default_sparams.top_p);
         slot->sparams.min_p             = json_value(data, "min_p",             default_sparams.min_p);
@@ -726,6 +1645,21 @@ struct llama_server_context
             }
         }
 
+        slot->stop_matcher.build(slot->params.antiprompt);
+
+        // a preempted task resumes with its earlier output folded into the
+        // prompt - seed generated_text with it so the final response of a
+        // non-streaming client still contains the pre-preemption tokens.
+        // the stop matcher is advanced over the prefix to keep its match
+        // positions aligned with generated_text
+        slot->generated_text  = json_value(data, "resume_prefix", std::string());
+        slot->n_resume_prefix = slot->generated_text.size();
+        slot->n_sent_text     = slot->n_resume_prefix;
+        if (!slot->stop_matcher.empty())
+        {
+            slot->stop_matcher.push(slot->generated_text);
+        }
+
         const auto &samplers_sequence = data.find("samplers");
         if (samplers_sequence != data.end() && samplers_sequence->is_array())
         {
@@ -751,7 +1685,26 @@ struct llama_server_context
             {
                 for (const auto &img : *images_data)
                 {
-                    const std::vector<uint8_t> image_buffer = base64_decode(img["data"].get<std::string>());
+                    std::vector<uint8_t> image_buffer;
+                    if (img.count("data") != 0)
+                    {
+                        image_buffer = base64_decode(img["data"].get<std::string>());
+                    }
+                    else if (img.count("buffer_index") != 0 &&
+                             img["buffer_index"].get<size_t>() < image_buffers.size())
+                    {
+                        // bytes already decoded by the streaming request parser
+                        image_buffer = std::move(image_buffers[img["buffer_index"].get<size_t>()]);
+                    }
+                    else if (img.count("upload_id") != 0 &&
+                             !take_uploaded_image(img["upload_id"].get<std::string>(), image_buffer))
+                    {
+                        LOG_ERROR("unknown image upload id", {
+                            {"slot_id",   slot->id},
+                            {"upload_id", img["upload_id"].get<std::string>()}
+                        });
+                        return false;
+                    }
 
                     slot_image img_sl;
                     img_sl.id = img.count("id") != 0 ? img["id"].get<int>() : slot->images.size();
@@ -768,7 +1721,39 @@ struct llama_server_context
                         {"slot_id",   slot->id},
                         {"img_sl_id", img_sl.id}
                     });
-                    img_sl.request_encode_image = true;
+
+                    img_sl.content_hash = image_embedding_cache::bytes_hash(image_buffer);
+
+                    const image_embedding_cache::entry *cached = image_cache.get(img_sl.content_hash);
+                    if (cached != nullptr)
+                    {
+                        // reuse the embedding, keeping the malloc'd-buffer ownership
+                        // the rest of the pipeline expects
+                        const size_t n_bytes = cached->embedding.size() * sizeof(float);
+                        img_sl.image_embedding = (float *) malloc(n_bytes);
+                        memcpy(img_sl.image_embedding, cached->embedding.data(), n_bytes);
+                        img_sl.image_tokens = cached->n_tokens;
+                        img_sl.request_encode_image = false;
+                        LOG_VERBOSE("image embedding reused from cache", {
+                            {"slot_id",   slot->id},
+                            {"img_sl_id", img_sl.id}
+                        });
+                    }
+                    else
+                    {
+                        // hand the pixels to the background encoder; the slot is
+                        // scheduled once the embedding is ready
+                        img_sl.request_encode_image = true;
+                        auto job = std::make_shared<image_encode_job>();
+                        job->img_data     = img_sl.img_data;
+                        img_sl.img_data   = nullptr; // owned by the job until encoded
+                        img_sl.encode_job = job;
+                        {
+                            std::lock_guard<std::mutex> lock(mutex_clip);
+                            clip_jobs.push_back(std::move(job));
+                        }
+                        condition_clip.notify_one();
+                    }
                     slot->images.push_back(img_sl);
                 }
                 // process prompt
@@ -821,7 +1806,41 @@ struct llama_server_context
         {
             llama_sampling_free(slot->ctx_sampling);
         }
-        slot->ctx_sampling = llama_sampling_init(slot->sparams);
+
+        const grammar_parser::parse_state *cached_grammar = nullptr;
+        if (!slot->sparams.grammar.empty())
+        {
+            bool hit = false;
+            cached_grammar = grammars.get(slot->sparams.grammar, hit);
+            if (hit)
+            {
+                metrics.n_grammar_cache_hits++;
+            }
+            else
+            {
+                metrics.n_grammar_cache_misses++;
+            }
+        }
+
+        if (cached_grammar != nullptr)
+        {
+            // install the cached grammar instead of re-parsing the text
+            std::string grammar_text = std::move(slot->sparams.grammar);
+            slot->sparams.grammar.clear();
+            slot->ctx_sampling = llama_sampling_init(slot->sparams);
+            slot->sparams.grammar = std::move(grammar_text);
+
+            slot->ctx_sampling->parsed_grammar = *cached_grammar;
+            std::vector<const llama_grammar_element *> rules = slot->ctx_sampling->parsed_grammar.c_rules();
+            slot->ctx_sampling->grammar = llama_grammar_init(
+                rules.data(), rules.size(),
+                slot->ctx_sampling->parsed_grammar.symbol_ids.at("root"));
+        }
+        else
+        {
+            // no grammar, or one that failed to parse - keep the old path
+            slot->ctx_sampling = llama_sampling_init(slot->sparams);
+        }
         llama_set_rng_seed(ctx, slot->params.seed);
         slot->command = LOAD_PROMPT;
 
@@ -838,10 +1857,88 @@ struct llama_server_context
     void kv_cache_clear() {
         // clear the entire KV cache
         llama_kv_cache_clear(ctx);
+        prefix_index.clear();
         clean_kv_cache = false;
+
+        // the persona sequences were wiped too - re-decode on next use
+        for (auto &el : personas)
+        {
+            el.second.decoded = false;
+        }
+    }
+
+    // decode a persona's prompt into its dedicated sequence - done once per
+    // persona, slots then receive the KV through a sequence copy
+    bool persona_decode(system_persona &persona) {
+        persona.tokens = ::llama_tokenize(ctx, persona.prompt, add_bos_token);
+
+        llama_kv_cache_seq_rm(ctx, persona.seq_id, 0, -1);
+        llama_batch_clear(batch);
+
+        for (int i = 0; i < (int)persona.tokens.size(); ++i)
+        {
+            llama_batch_add(batch, persona.tokens[i], i, { persona.seq_id }, false);
+        }
+
+        for (int32_t i = 0; i < (int32_t) batch.n_tokens; i += params.n_batch)
+        {
+            const int32_t n_tokens = std::min(params.n_batch, (int32_t) (batch.n_tokens - i));
+            llama_batch batch_view = {
+                n_tokens,
+                batch.token    + i,
+                nullptr,
+                batch.pos      + i,
+                batch.n_seq_id + i,
+                batch.seq_id   + i,
+                batch.logits   + i,
+                0, 0, 0, // unused
+            };
+            if (llama_decode(ctx, batch_view) != 0)
+            {
+                LOG_TEE("%s: llama_decode() failed\n", __func__);
+                return false;
+            }
+        }
+
+        persona.decoded = true;
+        return true;
     }
 
     void system_prompt_update() {
+        if (!pending_persona.empty())
+        {
+            system_persona &persona = personas.at(pending_persona);
+
+            if (!persona.decoded && !persona_decode(persona))
+            {
+                LOG_ERROR("failed to decode system persona", {{"name", pending_persona}});
+                system_need_update = false;
+                return;
+            }
+
+            // drop the slot sequences - their contents assume the previous
+            // system prompt. the persona sequences themselves are kept
+            for (int32_t i = 0; i < params.n_parallel; ++i)
+            {
+                llama_kv_cache_seq_rm(ctx, i, 0, -1);
+            }
+            prefix_index.clear();
+            clean_kv_cache = false;
+
+            system_prompt = persona.prompt;
+            system_tokens = persona.tokens;
+
+            // share the persona KV into every slot sequence - a copy, not a re-decode
+            for (int32_t i = 0; i < params.n_parallel; ++i)
+            {
+                llama_kv_cache_seq_cp(ctx, persona.seq_id, i, 0, system_tokens.size());
+            }
+
+            LOG_TEE("system prompt switched to persona '%s'\n", pending_persona.c_str());
+            system_need_update = false;
+            return;
+        }
+
         kv_cache_clear();
         system_tokens.clear();
 
@@ -896,47 +1993,77 @@ struct llama_server_context
         system_need_update = true;
     }
 
-    void system_prompt_process(const json &sys_props) {
-        system_prompt  = sys_props.value("prompt", "");
+    bool system_prompt_process(const json &sys_props) {
         name_user      = sys_props.value("anti_prompt", "");
         name_assistant = sys_props.value("assistant_name", "");
 
+        const std::string name = sys_props.value("name", "");
+        if (!name.empty())
+        {
+            auto it = personas.find(name);
+            if (it == personas.end())
+            {
+                if ((int32_t) personas.size() >= n_personas_max)
+                {
+                    LOG_ERROR("persona limit reached", {
+                        {"name",           name},
+                        {"n_personas",     personas.size()},
+                        {"n_personas_max", n_personas_max}
+                    });
+                    return false;
+                }
+                system_persona persona;
+                // persona sequences live in the extra sequences reserved at context init
+                persona.seq_id = params.n_parallel + (llama_seq_id) personas.size();
+                it = personas.emplace(name, persona).first;
+            }
+
+            if (sys_props.contains("prompt") && it->second.prompt != sys_props["prompt"])
+            {
+                it->second.prompt  = sys_props.value("prompt", "");
+                it->second.decoded = false;
+            }
+
+            pending_persona = name;
+        }
+        else
+        {
+            pending_persona.clear();
+            system_prompt = sys_props.value("prompt", "");
+        }
 
         system_prompt_notify();
+        return true;
     }
 
-    static size_t find_stopping_strings(const std::string &text, const size_t last_token_size,
-                                        const stop_type type, server_slot &slot)
+    // order just the first n_probs candidates by logit and append their
+    // softmax probabilities (normalized over the full candidate set) - a
+    // partial sort instead of llama_sample_softmax's full-vocab sort
+    static void top_probs(llama_token_data_array &cur_p, int32_t n_probs, std::vector<completion_token_output::token_prob> &probs)
     {
-        size_t stop_pos = std::string::npos;
+        const size_t k = std::min(cur_p.size, (size_t) n_probs);
+        if (k == 0)
+        {
+            return;
+        }
 
-        for (const std::string &word : slot.params.antiprompt)
+        std::partial_sort(cur_p.data, cur_p.data + k, cur_p.data + cur_p.size,
+                          [](const llama_token_data &a, const llama_token_data &b) {
+                              return a.logit > b.logit;
+                          });
+
+        // two O(n) passes for the normalization instead of a full softmax
+        const float max_logit = cur_p.data[0].logit;
+        double sum = 0.0;
+        for (size_t i = 0; i < cur_p.size; i++)
         {
-            size_t pos;
-            if (type == STOP_FULL)
-            {
-                const size_t tmp = word.size() + last_token_size;
-                const size_t from_pos = text.size() > tmp ? text.size() - tmp : 0;
-                pos = text.find(word, from_pos);
-            }
-            else
-            {
-                pos = find_partial_stop_string(word, text);
-            }
-            if (pos != std::string::npos &&
-                (stop_pos == std::string::npos || pos < stop_pos))
-            {
-                if (type == STOP_FULL)
-                {
-                    slot.stopped_word   = true;
-                    slot.stopping_word  = word;
-                    slot.has_next_token = false;
-                }
-                stop_pos = pos;
-            }
+            sum += expf(cur_p.data[i].logit - max_logit);
         }
 
-        return stop_pos;
+        for (size_t i = 0; i < k; i++)
+        {
+            probs.push_back({cur_p.data[i].id, (float) (expf(cur_p.data[i].logit - max_logit) / sum)});
+        }
     }
 
     bool process_token(completion_token_output &result, server_slot &slot) {
@@ -944,63 +2071,67 @@ struct llama_server_context
         const std::string token_str = llama_token_to_piece(ctx, result.tok);
         slot.sampled = result.tok;
 
+        {
+            const int64_t t_now = ggml_time_us();
+            if (slot.n_decoded == 1 && slot.t_queued > 0)
+            {
+                metrics.first_token_hist.observe((t_now - slot.t_queued) / 1e3);
+            }
+            if (slot.t_last_token > 0)
+            {
+                metrics.inter_token_hist.observe((t_now - slot.t_last_token) / 1e3);
+            }
+            slot.t_last_token = t_now;
+        }
+
         // search stop word and delete it
         slot.generated_text += token_str;
         slot.has_next_token = true;
 
-        if (slot.ctx_sampling->params.use_penalty_prompt_tokens && result.tok != -1)
+        // advance the stop-sequence automaton with just the new bytes
+        if (!slot.stop_matcher.empty())
         {
-            // we can change penalty_prompt_tokens because it is always created from scratch each request
-            slot.ctx_sampling->params.penalty_prompt_tokens.push_back(result.tok);
+            slot.stop_matcher.push(token_str);
         }
 
-        // check if there is incomplete UTF-8 character at the end
-        bool incomplete = false;
-        for (unsigned i = 1; i < 5 && i <= slot.generated_text.size(); ++i)
-        {
-            unsigned char c = slot.generated_text[slot.generated_text.size() - i];
-            if ((c & 0xC0) == 0x80)
-            {
-                // continuation byte: 10xxxxxx
-                continue;
-            }
-            if ((c & 0xE0) == 0xC0)
-            {
-                // 2-byte character: 110xxxxx ...
-                incomplete = i < 2;
-            }
-            else if ((c & 0xF0) == 0xE0)
-            {
-                // 3-byte character: 1110xxxx ...
-                incomplete = i < 3;
-            }
-            else if ((c & 0xF8) == 0xF0)
-            {
-                // 4-byte character: 11110xxx ...
-                incomplete = i < 4;
-            }
-            // else 1-byte character or invalid byte
-            break;
+        if (slot.ctx_sampling->params.use_penalty_prompt_tokens && result.tok != -1)
+        {
+            // we can change penalty_prompt_tokens because it is always created from scratch each request
+            slot.ctx_sampling->params.penalty_prompt_tokens.push_back(result.tok);
         }
 
+        // check if there is incomplete UTF-8 character at the end
+        slot.utf8_state.push(token_str);
+        const bool incomplete = slot.utf8_state.incomplete();
+
         if (!incomplete)
         {
             size_t pos = std::min(slot.n_sent_text, slot.generated_text.size());
-            const std::string str_test = slot.generated_text.substr(pos);
             bool is_stop_full = false;
-            size_t stop_pos = find_stopping_strings(str_test, token_str.size(), STOP_FULL, slot);
-            if (stop_pos != std::string::npos)
-            {
-                is_stop_full = true;
-                slot.generated_text.erase(
-                    slot.generated_text.begin() + pos + stop_pos,
-                    slot.generated_text.end());
-                pos = std::min(slot.n_sent_text, slot.generated_text.size());
-            }
-            else
+            size_t stop_pos = std::string::npos;
+            if (!slot.stop_matcher.empty())
             {
-                is_stop_full = false;
-                stop_pos = find_stopping_strings(str_test, token_str.size(), STOP_PARTIAL, slot);
+                if (slot.stop_matcher.match_pos != std::string::npos)
+                {
+                    is_stop_full = true;
+                    slot.stopped_word   = true;
+                    slot.stopping_word  = slot.generated_text.substr(slot.stop_matcher.match_pos, slot.stop_matcher.match_len);
+                    slot.has_next_token = false;
+                    stop_pos = slot.stop_matcher.match_pos >= pos ? slot.stop_matcher.match_pos - pos : 0;
+                    slot.generated_text.erase(
+                        slot.generated_text.begin() + slot.stop_matcher.match_pos,
+                        slot.generated_text.end());
+                    pos = std::min(slot.n_sent_text, slot.generated_text.size());
+                }
+                else
+                {
+                    // the tail of the generated text is a prefix of a stop string - hold it back
+                    const size_t partial = slot.stop_matcher.partial_len();
+                    if (partial > 0 && slot.generated_text.size() - partial >= pos)
+                    {
+                        stop_pos = slot.generated_text.size() - partial - pos;
+                    }
+                }
             }
 
             // check if there is any token to predict
@@ -1014,7 +2145,21 @@ struct llama_server_context
 
             if (slot.params.stream)
             {
-                send_partial_response(slot, result);
+                if (slot.n_coalesced_tokens == 0)
+                {
+                    slot.t_coalesce_start = ggml_time_us();
+                }
+                slot.coalesced_text += result.text_to_send;
+                slot.n_coalesced_tokens++;
+
+                const bool flush_count = slot.n_coalesced_tokens >= std::max(slot.params.stream_batch_tokens, 1);
+                const bool flush_time  = slot.params.stream_batch_ms > 0 &&
+                                         (ggml_time_us() - slot.t_coalesce_start) / 1000 >= slot.params.stream_batch_ms;
+
+                if (flush_count || flush_time || !slot.has_next_token)
+                {
+                    flush_partial_response(slot);
+                }
             }
         }
 
@@ -1054,8 +2199,63 @@ struct llama_server_context
         return slot.has_next_token; // continue
     }
 
-    bool process_images(server_slot &slot) const
+    // background thread: drains the encode queue, then wakes the task loop so
+    // slots waiting on their images get another scheduling round
+    void clip_worker_loop()
+    {
+        while (true)
+        {
+            std::shared_ptr<image_encode_job> job;
+            {
+                std::unique_lock<std::mutex> lock(mutex_clip);
+                condition_clip.wait(lock, [this]() { return !clip_jobs.empty() || !clip_running; });
+                if (!clip_running)
+                {
+                    return;
+                }
+                job = std::move(clip_jobs.front());
+                clip_jobs.erase(clip_jobs.begin());
+            }
+
+            float * embedding = nullptr;
+            int32_t n_tokens  = 0;
+            const bool ok = llava_image_embed_make_with_clip_img(clp_ctx, params.n_threads, job->img_data, &embedding, &n_tokens);
+
+            {
+                std::lock_guard<std::mutex> lock(mutex_clip);
+                clip_image_u8_free(job->img_data);
+                job->img_data  = nullptr;
+                job->embedding = embedding;
+                job->n_tokens  = n_tokens;
+                job->ok        = ok;
+                job->done      = true;
+            }
+
+            task_server task;
+            task.type = TASK_TYPE_NEXT_RESPONSE;
+            task.target_id = -1;
+            queue_tasks.post(task);
+        }
+    }
+
+    // true when no image of the slot is still being encoded in the background
+    bool slot_images_ready(server_slot &slot)
+    {
+        std::lock_guard<std::mutex> lock(mutex_clip);
+        for (const slot_image &img : slot.images)
+        {
+            if (img.request_encode_image && img.encode_job != nullptr && !img.encode_job->done)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool process_images(server_slot &slot)
     {
+        const int n_embd = llama_n_embd(model);
+
         for (slot_image &img : slot.images)
         {
             if (!img.request_encode_image)
@@ -1063,11 +2263,26 @@ struct llama_server_context
                 continue;
             }
 
-            if (!llava_image_embed_make_with_clip_img(clp_ctx, params.n_threads, img.img_data, &img.image_embedding, &img.image_tokens)) {
+            if (img.encode_job != nullptr)
+            {
+                // claim the result of the background encode
+                std::lock_guard<std::mutex> lock(mutex_clip);
+                if (!img.encode_job->ok)
+                {
+                    LOG_TEE("Error processing the given image");
+                    return false;
+                }
+                img.image_embedding     = img.encode_job->embedding;
+                img.image_tokens        = img.encode_job->n_tokens;
+                img.encode_job->claimed = true;
+                img.encode_job.reset();
+            }
+            else if (!llava_image_embed_make_with_clip_img(clp_ctx, params.n_threads, img.img_data, &img.image_embedding, &img.image_tokens)) {
                 LOG_TEE("Error processing the given image");
                 return false;
             }
 
+            image_cache.put(img.content_hash, img.image_embedding, img.image_tokens, n_embd);
 
             img.request_encode_image = false;
         }
@@ -1084,7 +2299,7 @@ struct llama_server_context
         res.stop = false;
         res.error = true;
         res.result_json = { { "content", error } };
-        queue_results.send(res);
+        queue_results.send(std::move(res));
     }
 
     json get_formated_generation(server_slot &slot)
@@ -1134,7 +2349,21 @@ struct llama_server_context
         };
     }
 
-    void send_partial_response(server_slot &slot, completion_token_output tkn)
+    // emit the coalesced text as one SSE chunk - with stream_batch_tokens=1
+    // (the default) this is called once per token, same as before
+    void flush_partial_response(server_slot &slot)
+    {
+        completion_token_output out;
+        out.tok          = -1;
+        out.text_to_send = std::move(slot.coalesced_text);
+
+        slot.coalesced_text.clear();
+        slot.n_coalesced_tokens = 0;
+
+        send_partial_response(slot, out);
+    }
+
+    void send_partial_response(server_slot &slot, const completion_token_output &tkn)
     {
         task_result res;
         res.id = slot.task_id;
@@ -1164,11 +2393,17 @@ struct llama_server_context
             res.result_json["completion_probabilities"] = probs_vector_to_json(ctx, probs_output);
         }
 
-        queue_results.send(res);
+        queue_results.send(std::move(res));
     }
 
     void send_final_response(server_slot &slot)
     {
+        // deliver any text still held back by the coalescing window
+        if (slot.params.stream && slot.n_coalesced_tokens > 0)
+        {
+            flush_partial_response(slot);
+        }
+
         task_result res;
         res.id = slot.task_id;
         res.multitask_id = slot.multitask_id;
@@ -1211,7 +2446,7 @@ struct llama_server_context
             res.result_json["completion_probabilities"] = probs_vector_to_json(ctx, probs);
         }
 
-        queue_results.send(res);
+        queue_results.send(std::move(res));
     }
 
     void send_embedding(server_slot & slot, const llama_batch & batch)
@@ -1258,19 +2493,86 @@ struct llama_server_context
                 };
             }
         }
-        queue_results.send(res);
+        queue_results.send(std::move(res));
+    }
+
+    // compute an embedding on the dedicated embedding model - called from the
+    // task handler, so embedding requests never occupy a completion slot
+    void send_embedding_aux(task_server &task)
+    {
+        task_result res;
+        res.id = task.id;
+        res.multitask_id = task.multitask_id;
+        res.error = false;
+        res.stop = true;
+
+        const int n_embd = llama_n_embd(model_embd);
+
+        std::vector<llama_token> tokens = ::llama_tokenize(ctx_embd, task.data["prompt"].get<std::string>(), llama_should_add_bos_token(model_embd));
+        const int n_ctx_embd = llama_n_ctx(ctx_embd);
+        if ((int) tokens.size() > n_ctx_embd)
+        {
+            tokens.resize(n_ctx_embd);
+        }
+
+        llama_kv_cache_clear(ctx_embd);
+
+        llama_batch batch_embd = llama_batch_init(std::max<int32_t>((int32_t) tokens.size(), 1), 0, 1);
+        for (size_t i = 0; i < tokens.size(); ++i)
+        {
+            llama_batch_add(batch_embd, tokens[i], i, { 0 }, i == tokens.size() - 1);
+        }
+
+        if (tokens.empty() || llama_decode(ctx_embd, batch_embd) != 0)
+        {
+            LOG_ERROR("embedding model decode failed", {{"task_id", task.id}});
+            res.result_json = json
+            {
+                {"embedding", std::vector<float>(n_embd, 0.0f)},
+            };
+        }
+        else
+        {
+            const float *embd = llama_get_embeddings_seq(ctx_embd, 0);
+            if (embd == NULL)
+            {
+                embd = llama_get_embeddings_ith(ctx_embd, batch_embd.n_tokens - 1);
+            }
+
+            if (embd == NULL)
+            {
+                LOG_ERROR("failed to get embeddings from embedding model", {{"task_id", task.id}});
+                res.result_json = json
+                {
+                    {"embedding", std::vector<float>(n_embd, 0.0f)},
+                };
+            }
+            else
+            {
+                res.result_json = json
+                {
+                    {"embedding", std::vector<float>(embd, embd + n_embd)},
+                };
+            }
+        }
+
+        llama_batch_free(batch_embd);
+        queue_results.send(std::move(res));
     }
 
-    void request_completion(int task_id, json data, bool infill, bool embedding, int multitask_id)
+    void request_completion(int task_id, json data, bool infill, bool embedding, int multitask_id,
+                            std::vector<std::vector<uint8_t>> image_buffers = std::vector<std::vector<uint8_t>>())
     {
         task_server task;
         task.id = task_id;
         task.target_id = 0;
         task.data = std::move(data);
+        task.image_buffers = std::move(image_buffers);
         task.infill_mode = infill;
         task.embedding_mode = embedding;
         task.type = TASK_TYPE_COMPLETION;
         task.multitask_id = multitask_id;
+        task.priority = json_value(task.data, "priority", 0);
 
         // when a completion task's prompt array is not a singleton, we split it into multiple requests
         // otherwise, it's a single-prompt task, we actually queue it
@@ -1290,7 +2592,7 @@ struct llama_server_context
             // if there are numbers, it needs to be treated like a single prompt,
             // queue_tasks handles a mix of strings and numbers just fine.
             if (numbers) {
-                queue_tasks.post(task);
+                queue_tasks.post(std::move(task));
             } else {
                 split_multiprompt_task(task_id, task);
             }
@@ -1299,7 +2601,7 @@ struct llama_server_context
             if (task.data.contains("prompt") && task.data["prompt"].is_string() && task.data["prompt"].get<std::string>().empty()) {
                 task.data["prompt"] = " "; // add a space so that we have one token
             }
-            queue_tasks.post(task);
+            queue_tasks.post(std::move(task));
         }
     }
 
@@ -1414,7 +2716,8 @@ struct llama_server_context
             subtask_data["prompt"] = subtask_data["prompt"][i];
 
             // subtasks inherit everything else (infill mode, embedding mode, etc.)
-            request_completion(subtask_ids[i], subtask_data, multiprompt_task.infill_mode, multiprompt_task.embedding_mode, multitask_id);
+            request_completion(subtask_ids[i], std::move(subtask_data), multiprompt_task.infill_mode, multiprompt_task.embedding_mode, multitask_id,
+                               multiprompt_task.image_buffers);
         }
     }
 
@@ -1423,7 +2726,76 @@ struct llama_server_context
         switch (task.type)
         {
             case TASK_TYPE_COMPLETION: {
-                server_slot *slot = get_slot(json_value(task.data, "slot_id", -1));
+                if (task.embedding_mode && ctx_embd != nullptr && task.data.contains("prompt") && task.data["prompt"].is_string())
+                {
+                    // routed to the dedicated embedding model, no slot needed
+                    send_embedding_aux(task);
+                    break;
+                }
+
+                server_slot *slot = get_slot(json_value(task.data, "slot_id", -1), task.data);
+                if (slot == nullptr && task.priority > 0)
+                {
+                    // all slots busy - preempt the lowest-priority running one
+                    // if this task outranks it. the victim is re-queued with
+                    // its generated text folded into the prompt, so it resumes
+                    // through the prompt cache instead of starting over
+                    // only slots that have actually started (release() is a no-op
+                    // before LOAD_PROMPT runs, and requeueing a not-yet-started
+                    // task would run it twice). image slots are also skipped: the
+                    // decoded image bytes cannot be rebuilt into the requeued task
+                    server_slot *victim = nullptr;
+                    for (server_slot &s : slots)
+                    {
+                        if (s.state == PROCESSING && s.images.empty() &&
+                            (victim == nullptr || s.priority < victim->priority))
+                        {
+                            victim = &s;
+                        }
+                    }
+
+                    if (victim != nullptr && victim->priority < task.priority)
+                    {
+                        LOG_INFO("preempting slot for higher priority task", {
+                            {"slot_id",       victim->id},
+                            {"task_id",       task.id},
+                            {"slot_priority", victim->priority},
+                            {"task_priority", task.priority},
+                        });
+
+                        task_server requeue;
+                        requeue.id             = victim->task_id;
+                        requeue.target_id      = 0;
+                        requeue.type           = TASK_TYPE_COMPLETION;
+                        requeue.multitask_id   = victim->multitask_id;
+                        requeue.infill_mode    = victim->infill;
+                        requeue.embedding_mode = victim->embedding;
+                        requeue.priority       = victim->priority;
+                        requeue.data           = victim->request_data;
+
+                        if (requeue.data.contains("prompt") && requeue.data["prompt"].is_string() &&
+                            victim->generated_text.size() > victim->n_resume_prefix)
+                        {
+                            // fold only the text generated since the last resume -
+                            // the prompt already contains any earlier resume prefix
+                            requeue.data["prompt"] = requeue.data["prompt"].get<std::string>() +
+                                                     victim->generated_text.substr(victim->n_resume_prefix);
+                        }
+                        if (!victim->generated_text.empty())
+                        {
+                            // re-seeded into generated_text on relaunch so the final
+                            // response still contains the pre-preemption output
+                            requeue.data["resume_prefix"] = victim->generated_text;
+                        }
+                        if (victim->params.n_predict > 0)
+                        {
+                            requeue.data["n_predict"] = std::max(victim->params.n_predict - victim->n_decoded, 1);
+                        }
+
+                        victim->release();
+                        queue_tasks.defer(std::move(requeue));
+                    }
+                }
                 if (slot == nullptr)
                 {
                     // if no slot is available, we defer this task for processing later
@@ -1438,7 +2810,10 @@ struct llama_server_context
                         send_error(task, "system prompt can only be updated when all slots are idle");
                         break;
                     }
-                    system_prompt_process(task.data["system_prompt"]);
+                    if (!system_prompt_process(task.data["system_prompt"])) {
+                        send_error(task, "persona limit reached");
+                        break;
+                    }
 
                     // reset cache_tokens for all slots
                     for (server_slot &slot : slots)
@@ -1454,9 +2829,16 @@ struct llama_server_context
                 slot->infill       = task.infill_mode;
                 slot->embedding    = task.embedding_mode;
                 slot->task_id      = task.id;
+                task_to_slot[task.id] = slot;
                 slot->multitask_id = task.multitask_id;
+                slot->t_queued     = task.t_posted;
 
-                if (!launch_slot_with_data(slot, task.data))
+                if (task.t_posted > 0)
+                {
+                    metrics.queue_wait_hist.observe((ggml_time_us() - task.t_posted) / 1e3);
+                }
+
+                if (!launch_slot_with_data(slot, std::move(task.data), std::move(task.image_buffers)))
                 {
                     // send error result
                     send_error(task, "internal_error");
@@ -1464,13 +2846,10 @@ struct llama_server_context
                 }
             } break;
             case TASK_TYPE_CANCEL: { // release slot linked with the task id
-                for (auto & slot : slots)
+                auto it = task_to_slot.find(task.target_id);
+                if (it != task_to_slot.end() && it->second->task_id == task.target_id)
                 {
-                    if (slot.task_id == task.target_id)
-                    {
-                        slot.release();
-                        break;
-                    }
+                    it->second->release();
                 }
             } break;
             case TASK_TYPE_NEXT_RESPONSE: {
@@ -1527,6 +2906,12 @@ struct llama_server_context
                         { "n_prompt_tokens_processed_total", metrics.n_prompt_tokens_processed_total},
                         { "n_tokens_predicted_total",        metrics.n_tokens_predicted_total},
 
+                        { "n_kv_session_hits",               metrics.n_kv_session_hits},
+                        { "n_kv_session_misses",             metrics.n_kv_session_misses},
+
+                        { "n_grammar_cache_hits",            metrics.n_grammar_cache_hits},
+                        { "n_grammar_cache_misses",          metrics.n_grammar_cache_misses},
+
                         { "n_prompt_tokens_processed",       metrics.n_prompt_tokens_processed},
                         { "t_prompt_processing",             metrics.t_prompt_processing},
                         { "n_tokens_predicted",              metrics.n_tokens_predicted},
@@ -1538,7 +2923,7 @@ struct llama_server_context
                         { "slots",                           slots_data },
                 };
                 metrics.reset_bucket();
-                queue_results.send(res);
+                queue_results.send(std::move(res));
             } break;
         }
     }
@@ -1551,18 +2936,228 @@ struct llama_server_context
         result.stop = true;
         result.error = false;
 
-        // collect json results into one json result
+        // collect json results into one json result, ordered by subtask id so
+        // the responses line up with the inputs (ids are assigned in input order)
+        std::sort(multitask.results.begin(), multitask.results.end(),
+            [](const task_result & a, const task_result & b) {
+                return a.id < b.id;
+            });
+
         std::vector<json> result_jsons;
+        result_jsons.reserve(multitask.results.size());
         for (auto& subres : multitask.results)
         {
-            result_jsons.push_back(subres.result_json);
             result.error = result.error && subres.error;
+            result_jsons.push_back(std::move(subres.result_json));
+        }
+        result.result_json = json{ { "results", std::move(result_jsons) } };
+        queue_results.send(std::move(result));
+    }
+
+    // bring the draft context in sync with the slot's sequence
+    // (system tokens + the first n_past cached tokens)
+    bool draft_sync(server_slot & slot) {
+        std::vector<llama_token> target;
+        target.reserve(system_tokens.size() + slot.n_past);
+        target.insert(target.end(), system_tokens.begin(), system_tokens.end());
+        target.insert(target.end(), slot.cache_tokens.begin(), slot.cache_tokens.begin() + slot.n_past);
+
+        const size_t common = common_part(draft_tokens, target);
+
+        llama_kv_cache_seq_rm(ctx_draft, 0, common, -1);
+        draft_tokens.resize(common);
+
+        for (size_t i = common; i < target.size(); i += params.n_batch)
+        {
+            llama_batch_clear(batch_draft);
+            const size_t n_eval = std::min((size_t) params.n_batch, target.size() - i);
+            for (size_t k = 0; k < n_eval; k++)
+            {
+                llama_batch_add(batch_draft, target[i + k], i + k, { 0 }, false);
+            }
+            if (llama_decode(ctx_draft, batch_draft) != 0)
+            {
+                LOG_TEE("%s: failed to decode prompt on the draft model\n", __func__);
+                return false;
+            }
+            draft_tokens.insert(draft_tokens.end(), target.begin() + i, target.begin() + i + n_eval);
+        }
+
+        return true;
+    }
+
+    // speculative decoding: propose n_draft tokens greedily with the draft
+    // model, verify them in one batched decode on the target model, and run
+    // every accepted token through the regular process_token() flow. the
+    // slot's pending `sampled` token stays pending, as in the normal path.
+    void speculate(server_slot & slot) {
+        if (!draft_sync(slot))
+        {
+            return;
+        }
+
+        const int n_vocab_draft = llama_n_vocab(model_draft);
+
+        // propose: decode the pending token, then extend greedily
+        std::vector<llama_token> drafts;
+        llama_token cur = slot.sampled;
+        int32_t draft_pos = system_tokens.size() + slot.n_past;
+
+        for (int i = 0; i < params.n_draft; i++)
+        {
+            llama_batch_clear(batch_draft);
+            llama_batch_add(batch_draft, cur, draft_pos, { 0 }, true);
+            if (llama_decode(ctx_draft, batch_draft) != 0)
+            {
+                return;
+            }
+            draft_tokens.push_back(cur);
+            draft_pos++;
+
+            const float *logits = llama_get_logits_ith(ctx_draft, 0);
+            llama_token best = 0;
+            for (llama_token tok = 1; tok < n_vocab_draft; tok++)
+            {
+                if (logits[tok] > logits[best])
+                {
+                    best = tok;
+                }
+            }
+            drafts.push_back(best);
+            cur = best;
+        }
+
+        const int n_drafted = drafts.size();
+        if (n_drafted == 0)
+        {
+            return;
+        }
+
+        // verify: decode pending + drafts in one batch on the target model
+        llama_batch_clear(batch);
+        llama_batch_add(batch, slot.sampled, system_tokens.size() + slot.n_past, { slot.id }, true);
+        for (int i = 0; i < n_drafted; i++)
+        {
+            llama_batch_add(batch, drafts[i], system_tokens.size() + slot.n_past + 1 + i, { slot.id }, true);
+        }
+
+        if (llama_decode(ctx, batch) != 0)
+        {
+            LOG_TEE("%s: failed to decode speculative batch\n", __func__);
+            llama_kv_cache_seq_rm(ctx, slot.id, system_tokens.size() + slot.n_past, -1);
+            return;
+        }
+
+        // accept the target model's samples while they agree with the draft
+        int n_kept = 0;
+        for (int j = 0; j <= n_drafted; j++)
+        {
+            completion_token_output result;
+            const llama_token id = llama_sampling_sample(slot.ctx_sampling, ctx, NULL, j);
+
+            llama_sampling_accept(slot.ctx_sampling, ctx, id, true);
+
+            slot.n_decoded += 1;
+
+            llama_token_data_array cur_p = { slot.ctx_sampling->cur.data(), slot.ctx_sampling->cur.size(), false };
+            result.tok = id;
+
+            const int32_t n_probs = slot.sparams.n_probs;
+            if (slot.sparams.temp <= 0 && n_probs > 0)
+            {
+                // same partial top-k as the regular sampling loop
+                top_probs(cur_p, n_probs, result.probs);
+            }
+            else
+            {
+                for (size_t k = 0; k < std::min(cur_p.size, (size_t) n_probs); ++k)
+                {
+                    result.probs.push_back({cur_p.data[k].id, cur_p.data[k].p});
+                }
+            }
+
+            const bool cont = process_token(result, slot);
+
+            n_kept = j + 1;
+
+            if (!cont)
+            {
+                slot.release();
+                slot.print_timings();
+                send_final_response(slot);
+                metrics.on_prediction(slot);
+                break;
+            }
+
+            if (j < n_drafted && id == drafts[j])
+            {
+                // the draft guessed right - its token is already in the KV cache
+                continue;
+            }
+
+            // mismatch (or drafts exhausted): `id` becomes the new pending token
+            slot.sampled = id;
+            break;
+        }
+
+        // commit the accepted inputs, drop the speculated tail
+        slot.n_past += n_kept;
+        llama_kv_cache_seq_rm(ctx, slot.id, system_tokens.size() + slot.n_past, -1);
+
+        LOG_VERBOSE("speculative round", {
+            {"slot_id",   slot.id},
+            {"n_drafted", n_drafted},
+            {"n_kept",    n_kept},
+        });
+    }
+
+    void publish_slots_snapshot() {
+        // single writer (the inference thread)
+        snapshot_version.fetch_add(1, std::memory_order_acq_rel);
+
+        snapshot_slots.resize(slots.size());
+        for (size_t i = 0; i < slots.size(); i++) {
+            const server_slot &slot = slots[i];
+            slot_snapshot &snap = snapshot_slots[i];
+
+            snap.id                  = slot.id;
+            snap.task_id             = slot.task_id;
+            snap.state               = slot.state;
+            snap.n_ctx               = slot.n_ctx;
+            snap.n_past              = slot.n_past;
+            snap.n_decoded           = slot.n_decoded;
+            snap.n_remaining         = slot.n_remaining;
+            snap.t_prompt_processing = slot.t_prompt_processing;
+            snap.t_token_generation  = slot.t_token_generation;
+        }
+
+        snapshot_version.fetch_add(1, std::memory_order_acq_rel);
+    }
+
+    // safe to call from any HTTP thread, never touches the task queue
+    std::vector<slot_snapshot> read_slots_snapshot() {
+        std::vector<slot_snapshot> out;
+        while (true) {
+            const uint64_t version = snapshot_version.load(std::memory_order_acquire);
+            if (version & 1) {
+                std::this_thread::yield();
+                continue;
+            }
+            out = snapshot_slots;
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (snapshot_version.load(std::memory_order_relaxed) == version) {
+                return out;
+            }
         }
-        result.result_json = json{ { "results", result_jsons } };
-        queue_results.send(result);
     }
 
     bool update_slots() {
+        const bool keep_going = update_slots_impl();
+        publish_slots_snapshot();
+        return keep_going;
+    }
+
+    bool update_slots_impl() {
         if (system_need_update)
         {
             LOG_INFO("updating system prompt", {});
@@ -1594,9 +3189,37 @@ struct llama_server_context
                 if (slot.is_processing() && system_tokens.size() + slot.cache_tokens.size() >= (size_t) slot.n_ctx)
                 {
                     // Shift context
-                    const int n_keep    = slot.params.n_keep + add_bos_token;
+                    int n_keep = slot.params.n_keep + add_bos_token;
+                    if (n_attention_sinks > 0)
+                    {
+                        // pin the sink tokens so the start of the stream survives every shift
+                        n_keep = std::max(n_keep, (int) system_tokens.size() + n_attention_sinks);
+                    }
+
+                    // n_keep is an absolute KV position: the system prompt is always
+                    // kept, and nothing beyond what the slot has decoded can be
+                    n_keep = std::max(n_keep, (int) system_tokens.size());
+                    n_keep = std::min(n_keep, (int) system_tokens.size() + slot.n_past);
+
+                    // cache_tokens indices exclude the system prompt
+                    const int n_keep_cache = n_keep - (int) system_tokens.size();
+
                     const int n_left    = (int) system_tokens.size() + slot.n_past - n_keep;
-                    const int n_discard = n_left / 2;
+                    const int n_discard = std::min(std::max(1, (int) (n_left * ctx_shift_discard)),
+                                                   slot.n_past - n_keep_cache);
+
+                    if (n_discard <= 0)
+                    {
+                        // n_keep pins everything the slot has decoded - nothing to shift out
+                        LOG_WARNING("context shift skipped, n_keep covers the whole cache", {
+                            {"slot_id", slot.id},
+                            {"task_id", slot.task_id},
+                            {"n_keep",  n_keep},
+                            {"n_past",  slot.n_past},
+                            {"n_ctx",   n_ctx}
+                        });
+                        continue;
+                    }
 
                     LOG_INFO("slot context shift", {
                         {"slot_id",         slot.id},
@@ -1612,12 +3235,9 @@ struct llama_server_context
                     llama_kv_cache_seq_rm (ctx, slot.id, n_keep            , n_keep + n_discard);
                     llama_kv_cache_seq_add(ctx, slot.id, n_keep + n_discard, system_tokens.size() + slot.n_past, -n_discard);
 
-                    for (size_t i = n_keep + n_discard; i < slot.cache_tokens.size(); i++)
-                    {
-                        slot.cache_tokens[i - n_discard] = slot.cache_tokens[i];
-                    }
-
-                    slot.cache_tokens.resize(slot.cache_tokens.size() - n_discard);
+                    // single memmove of the tail instead of an element-by-element copy
+                    slot.cache_tokens.erase(slot.cache_tokens.begin() + n_keep_cache,
+                                            slot.cache_tokens.begin() + n_keep_cache + n_discard);
 
                     slot.n_past -= n_discard;
 
@@ -1635,7 +3255,9 @@ struct llama_server_context
             {
                 slot.state = IDLE;
                 slot.command = NONE;
+                slot.prefilling = false;
                 slot.t_last_used = ggml_time_us();
+                task_to_slot.erase(slot.task_id);
 
                 LOG_INFO("slot released", {
                     {"slot_id",         slot.id},
@@ -1646,6 +3268,24 @@ struct llama_server_context
                     {"n_cache_tokens",  slot.cache_tokens.size()},
                     {"truncated",       slot.truncated}
                 });
+
+                // the slot's KV cache stays valid until it is reassigned - index it
+                // so other slots can reuse the shared prefix
+                if (slot.ga_n == 1)
+                {
+                    prefix_index.erase(slot.id);
+                    // only the first n_past tokens were decoded into the KV cache:
+                    // cache_tokens also holds the last sampled token on a normal
+                    // finish, and the whole prompt when a prefill was cancelled
+                    prefix_index.insert(slot.id, slot.cache_tokens, slot.n_past);
+                }
+
+                // persist the sequence state so the conversation survives eviction
+                if (kv_sessions.enabled() && slot.ga_n == 1 && slot.params.cache_prompt && slot.n_past > 0)
+                {
+                    kv_sessions.save(ctx, slot.id, slot.cache_tokens, slot.n_past, system_tokens);
+                }
+
                 queue_tasks.notify_slot_changed();
 
                 continue;
@@ -1656,6 +3296,12 @@ struct llama_server_context
                 continue;
             }
 
+            // slots mid-prefill have no sampled token yet
+            if (slot.prefilling)
+            {
+                continue;
+            }
+
             slot.i_batch = batch.n_tokens;
 
             const int32_t slot_npast = slot.n_past_se > 0 ? slot.n_past_se : slot.n_past;
@@ -1670,7 +3316,6 @@ struct llama_server_context
         int32_t n_batch = params.n_batch;
 
         // assign workload to the slots
-        if (params.cont_batching || batch.n_tokens == 0)
         {
             for (auto & slot : slots)
             {
@@ -1686,11 +3331,51 @@ struct llama_server_context
                     continue;
                 }
 
+                // continue a prefill that was split across scheduling rounds
+                if (slot.state == PROCESSING && slot.prefilling && slot.command == NONE)
+                {
+                    int32_t n_budget = n_prefill_chunk;
+                    for (; slot.n_past < (int32_t) slot.cache_tokens.size() && n_budget > 0; ++slot.n_past, --n_budget)
+                    {
+                        llama_batch_add(batch, slot.cache_tokens[slot.n_past], system_tokens.size() + slot.n_past, { slot.id }, false);
+                    }
+
+                    if (slot.n_past == (int32_t) slot.cache_tokens.size())
+                    {
+                        // prompt fully ingested - extract logits for the last token
+                        batch.logits[batch.n_tokens - 1] = true;
+                        slot.n_decoded = 0;
+                        slot.i_batch   = batch.n_tokens - 1;
+                        slot.prefilling = false;
+                    }
+                    continue;
+                }
+
                 // need process the prompt
                 if (slot.state == IDLE && slot.command == LOAD_PROMPT)
                 {
+                    // without continuous batching, only embedding tasks (which are
+                    // prefill-only) may join a batch that already holds tokens -
+                    // this is what lets an array of embedding inputs pack multiple
+                    // sequences into a single llama_batch
+                    if (!params.cont_batching && batch.n_tokens > 0 && !slot.embedding)
+                    {
+                        continue;
+                    }
+
+                    // images for this slot may still be encoding in the background -
+                    // let running slots keep decoding and revisit it next round
+                    if (!slot_images_ready(slot))
+                    {
+                        continue;
+                    }
+
                     slot.state = PROCESSING;
                     slot.command = NONE;
+
+                    // the slot's cache is about to be rewritten, stop advertising it
+                    prefix_index.erase(slot.id);
+
                     std::vector<llama_token> prompt_tokens;
                     slot.t_start_process_prompt = ggml_time_us();
                     slot.t_start_genereration = 0;
@@ -1787,6 +3472,60 @@ struct llama_server_context
 
                         slot.n_prompt_tokens_processed = slot.n_prompt_tokens - slot.n_past;
 
+                        // check whether another slot's KV cache holds a longer shared
+                        // prefix of this prompt than our own cache does
+                        if (slot.ga_n == 1 && slot.n_past < (int32_t) prompt_tokens.size())
+                        {
+                            int donor_id = -1;
+                            size_t n_shared = prefix_index.find(prompt_tokens, slot.id, donor_id);
+
+                            // the last prompt token must be re-evaluated to produce logits
+                            if (n_shared >= prompt_tokens.size())
+                            {
+                                n_shared = prompt_tokens.size() - 1;
+                            }
+
+                            if (donor_id != -1 && (int32_t) n_shared > slot.n_past)
+                            {
+                                const int32_t n_sys = system_tokens.size();
+
+                                llama_kv_cache_seq_rm(ctx, slot.id, n_sys, -1);
+                                llama_kv_cache_seq_cp(ctx, donor_id, slot.id, n_sys, n_sys + (int32_t) n_shared);
+
+                                slot.n_past = n_shared;
+                                slot.n_prompt_tokens_processed = slot.n_prompt_tokens - slot.n_past;
+
+                                LOG_INFO("reusing shared prompt prefix", {
+                                    { "slot_id",       slot.id },
+                                    { "task_id",       slot.task_id },
+                                    { "donor_slot_id", donor_id },
+                                    { "n_shared",      n_shared }
+                                });
+                            }
+                        }
+
+                        // failing that, try to restore a persisted KV session
+                        if (kv_sessions.enabled() && slot.ga_n == 1 && slot.n_past < (int32_t) prompt_tokens.size() - 1)
+                        {
+                            const size_t n_restored = kv_sessions.restore(ctx, slot.id, prompt_tokens, system_tokens, slot.n_past);
+                            if (n_restored > 0)
+                            {
+                                slot.n_past = n_restored;
+                                slot.n_prompt_tokens_processed = slot.n_prompt_tokens - slot.n_past;
+                                metrics.n_kv_session_hits++;
+
+                                LOG_INFO("restored KV session", {
+                                    { "slot_id",    slot.id },
+                                    { "task_id",    slot.task_id },
+                                    { "n_restored", n_restored }
+                                });
+                            }
+                            else
+                            {
+                                metrics.n_kv_session_misses++;
+                            }
+                        }
+
                         if (slot.ga_n != 1)
                         {
                             int ga_i = 0;
@@ -1857,7 +3596,14 @@ struct llama_server_context
                     int32_t ga_n = slot.ga_n;
                     int32_t ga_w = slot.ga_w;
 
-                    for (; slot.n_past < (int) prefix_tokens.size(); ++slot.n_past)
+                    // chunked prefill: cap this slot's contribution to the batch so
+                    // running slots keep decoding; the remainder is ingested in later
+                    // rounds. multimodal and self-extend keep the single-pass path
+                    int32_t n_prefill_budget = (n_prefill_chunk > 0 && !has_images && slot.ga_n == 1)
+                        ? n_prefill_chunk
+                        : std::numeric_limits<int32_t>::max();
+
+                    for (; slot.n_past < (int) prefix_tokens.size() && n_prefill_budget > 0; ++slot.n_past, --n_prefill_budget)
                     {
                         if (slot.ga_n != 1)
                         {
@@ -1871,6 +3617,14 @@ struct llama_server_context
                         slot_npast++;
                     }
 
+                    if (!has_images && slot.n_past < (int) prefix_tokens.size())
+                    {
+                        // out of budget - resume in the next round
+                        slot.prefilling = true;
+                        slot.i_batch = -1;
+                        continue;
+                    }
+
                     if (has_images && !ingest_images(slot, n_batch))
                     {
                         LOG_ERROR("failed processing images", {
@@ -1927,116 +3681,581 @@ struct llama_server_context
 
                         slot.n_past_se -= bd;
 
-                        slot.ga_i += slot.ga_w / slot.ga_n;
+                        slot.ga_i += slot.ga_w / slot.ga_n;
+
+                        LOG_TEE("\nn_past_old = %d, n_past = %d, ga_i = %d\n\n", slot.n_past_se + bd, slot.n_past_se, slot.ga_i);
+                    }
+                    slot.n_past_se += n_tokens;
+                }
+            }
+
+            llama_batch batch_view =
+            {
+                n_tokens,
+                batch.token    + i,
+                nullptr,
+                batch.pos      + i,
+                batch.n_seq_id + i,
+                batch.seq_id   + i,
+                batch.logits   + i,
+                0, 0, 0, // unused
+            };
+
+            const int ret = llama_decode(ctx, batch_view);
+
+            if (ret != 0)
+            {
+                if (n_batch == 1 || ret < 0)
+                {
+                    // if you get here, it means the KV cache is full - try increasing it via the context size
+                    LOG_TEE("%s : failed to decode the batch, n_batch = %d, ret = %d\n", __func__, n_batch, ret);
+                    return false;
+                }
+
+                LOG_TEE("%s : failed to find free space in the KV cache, retrying with smaller n_batch = %d\n", __func__, n_batch / 2);
+
+                // retry with half the batch size to try to find a free slot in the KV cache
+                n_batch /= 2;
+                i -= n_batch;
+                continue;
+            }
+
+            for (auto & slot : slots)
+            {
+                if (slot.i_batch < (int) i || slot.i_batch >= (int) (i + n_tokens))
+                {
+                    continue;
+                }
+
+                // prompt evaluated for embedding
+                if (slot.embedding)
+                {
+                    send_embedding(slot, batch_view);
+                    slot.release();
+                    slot.i_batch = -1;
+                    continue;
+                }
+
+                completion_token_output result;
+                const llama_token id = llama_sampling_sample(slot.ctx_sampling, ctx, NULL, slot.i_batch - i);
+
+                llama_sampling_accept(slot.ctx_sampling, ctx, id, true);
+
+                slot.n_decoded += 1;
+                if (slot.n_decoded == 1)
+                {
+                    slot.t_start_genereration = ggml_time_us();
+                    slot.t_prompt_processing = (slot.t_start_genereration - slot.t_start_process_prompt) / 1e3;
+                    metrics.on_prompt_eval(slot);
+                }
+
+                llama_token_data_array cur_p = { slot.ctx_sampling->cur.data(), slot.ctx_sampling->cur.size(), false };
+                result.tok = id;
+
+                const int32_t n_probs = slot.sparams.n_probs;
+                if (slot.sparams.temp <= 0 && n_probs > 0)
+                {
+                    // greedy sampling leaves the candidates unsorted - order
+                    // only the n_probs head instead of the whole vocabulary
+                    top_probs(cur_p, n_probs, result.probs);
+                }
+                else
+                {
+                    for (size_t i = 0; i < std::min(cur_p.size, (size_t)n_probs); ++i)
+                    {
+                        result.probs.push_back({cur_p.data[i].id, cur_p.data[i].p});
+                    }
+                }
+
+                if (!process_token(result, slot))
+                {
+                    slot.release();
+                    slot.print_timings();
+                    send_final_response(slot);
+                    metrics.on_prediction(slot);
+                }
+
+                // speculative decoding fast path: a single decode-bound stream
+                // (the whole batch was this slot's one token) can extend the
+                // round with draft-verified tokens
+                if (ctx_draft != nullptr && slot.has_next_token && !slot.embedding && slot.ga_n == 1 && batch.n_tokens == 1)
+                {
+                    speculate(slot);
+                }
+
+                slot.i_batch = -1;
+            }
+        }
+
+        LOG_VERBOSE("slots updated", {});
+        return true;
+    }
+
+    json model_meta() {
+        return json{
+                {"vocab_type", llama_vocab_type(model)},
+                {"n_vocab", llama_n_vocab(model)},
+                {"n_ctx_train", llama_n_ctx_train(model)},
+                {"n_embd", llama_n_embd(model)},
+                {"n_params", llama_model_n_params(model)},
+                {"size", llama_model_size(model)},
+        };
+    }
+};
+
+#if defined(__linux__)
+// epoll-based front end for streaming completions (--sse-port). long-lived SSE
+// connections are parked on one event loop thread, with writes driven by result
+// arrival through llama_server_response::callback_result_ready, instead of each
+// stream pinning a blocked httplib pool thread. the httplib server keeps
+// handling everything else
+struct server_event_loop {
+    struct connection {
+        int fd      = -1;
+        int task_id = -1;
+
+        std::string in;  // accumulated request bytes
+        std::string out; // bytes waiting for the socket
+
+        size_t header_end     = std::string::npos;
+        size_t content_length = 0;
+
+        bool streaming = false; // task posted, SSE in progress
+        bool finished  = false; // close once out is drained
+    };
+
+    // upper bound on a buffered request (headers + body); generous enough
+    // for base64 image payloads, small enough that a client cannot grow
+    // conn.in without limit
+    static const size_t max_request_bytes = 32 * 1024 * 1024;
+
+    llama_server_context *llama = nullptr;
+
+    // same keys as the httplib front end - empty means no authentication
+    std::vector<std::string> api_keys;
+
+    int fd_epoll  = -1;
+    int fd_listen = -1;
+    int fd_event  = -1;
+
+    std::thread worker;
+    std::atomic<bool> running{false};
+
+    std::unordered_map<int, connection> conns; // socket fd -> connection
+    std::unordered_map<int, int> task_to_fd;
+
+    // task ids with results pending, filled by the inference thread
+    std::mutex mutex_ready;
+    std::vector<int> ready_tasks;
+
+    static bool set_nonblocking(int fd) {
+        const int flags = fcntl(fd, F_GETFL, 0);
+        return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+    }
+
+    bool start(llama_server_context &ctx, const std::string &host, int port) {
+        llama = &ctx;
+
+        fd_listen = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd_listen < 0)
+        {
+            LOG_ERROR("unable to create sse socket", {{"port", port}});
+            return false;
+        }
+
+        const int yes = 1;
+        setsockopt(fd_listen, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+        sockaddr_in addr = {};
+        addr.sin_family      = AF_INET;
+        addr.sin_port        = htons((uint16_t) port);
+        addr.sin_addr.s_addr = host.empty() ? INADDR_ANY : inet_addr(host.c_str());
+
+        if (bind(fd_listen, (sockaddr *) &addr, sizeof(addr)) != 0 ||
+            listen(fd_listen, 128) != 0 ||
+            !set_nonblocking(fd_listen))
+        {
+            LOG_ERROR("unable to bind sse port", {{"hostname", host}, {"port", port}});
+            close(fd_listen);
+            fd_listen = -1;
+            return false;
+        }
+
+        fd_epoll = epoll_create1(0);
+        fd_event = eventfd(0, EFD_NONBLOCK);
+
+        epoll_event ev = {};
+        ev.events  = EPOLLIN;
+        ev.data.fd = fd_listen;
+        epoll_ctl(fd_epoll, EPOLL_CTL_ADD, fd_listen, &ev);
+        ev.data.fd = fd_event;
+        epoll_ctl(fd_epoll, EPOLL_CTL_ADD, fd_event, &ev);
+
+        llama->queue_results.callback_result_ready = [this](int task_id) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_ready);
+                ready_tasks.push_back(task_id);
+            }
+            wake();
+        };
+
+        running.store(true);
+        worker = std::thread(&server_event_loop::run, this);
+
+        LOG_INFO("sse event loop listening", {{"hostname", host}, {"port", port}});
+        return true;
+    }
+
+    void stop() {
+        if (!running.load())
+        {
+            return;
+        }
+        running.store(false);
+        wake();
+        worker.join();
+
+        llama->queue_results.callback_result_ready = nullptr;
+
+        for (auto &el : conns)
+        {
+            close(el.first);
+        }
+        conns.clear();
+        task_to_fd.clear();
+
+        close(fd_event);
+        close(fd_listen);
+        close(fd_epoll);
+        fd_event = fd_listen = fd_epoll = -1;
+    }
+
+    void wake() {
+        const uint64_t one = 1;
+        const ssize_t n = write(fd_event, &one, sizeof(one));
+        (void) n;
+    }
+
+    void update_events(connection &conn) {
+        epoll_event ev = {};
+        ev.data.fd = conn.fd;
+        ev.events  = EPOLLIN | (conn.out.empty() ? 0 : EPOLLOUT);
+        epoll_ctl(fd_epoll, EPOLL_CTL_MOD, conn.fd, &ev);
+    }
+
+    void close_connection(int fd) {
+        auto it = conns.find(fd);
+        if (it == conns.end())
+        {
+            return;
+        }
+
+        connection &conn = it->second;
+        if (conn.task_id != -1)
+        {
+            // client went away mid-stream - stop the generation
+            llama->request_cancel(conn.task_id);
+            llama->queue_results.remove_waiting_task_id(conn.task_id);
+            task_to_fd.erase(conn.task_id);
+        }
+
+        epoll_ctl(fd_epoll, EPOLL_CTL_DEL, fd, nullptr);
+        close(fd);
+        conns.erase(it);
+    }
+
+    // Authorization: Bearer <key> against api_keys. the lowercased copy is
+    // only used to locate the header - the value keeps its original case
+    bool check_api_key(const connection &conn) const {
+        std::string headers = conn.in.substr(0, conn.header_end);
+        std::transform(headers.begin(), headers.end(), headers.begin(), ::tolower);
+
+        const size_t pos = headers.find("authorization:");
+        if (pos == std::string::npos)
+        {
+            return false;
+        }
+
+        const size_t value_begin = pos + sizeof("authorization:") - 1;
+        const size_t value_end   = conn.in.find("\r\n", value_begin);
+        std::string value = conn.in.substr(value_begin, value_end - value_begin);
+        value.erase(0, value.find_first_not_of(" \t"));
+
+        const std::string prefix = "Bearer ";
+        if (value.compare(0, prefix.size(), prefix) != 0)
+        {
+            return false;
+        }
+
+        const std::string received_api_key = value.substr(prefix.size());
+        return std::find(api_keys.begin(), api_keys.end(), received_api_key) != api_keys.end();
+    }
+
+    void handle_request(connection &conn) {
+        const std::string body = conn.in.substr(conn.header_end + 4, conn.content_length);
+
+        // only streaming completions are served here
+        if (conn.in.compare(0, 16, "POST /completion") != 0)
+        {
+            conn.out += "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+            conn.finished = true;
+            return;
+        }
+
+        // mirror the validate_api_key middleware of the httplib front end
+        if (!api_keys.empty() && !check_api_key(conn))
+        {
+            LOG_WARNING("Unauthorized: Invalid API Key", {});
+            conn.out += "HTTP/1.1 401 Unauthorized\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+            conn.finished = true;
+            return;
+        }
+
+        std::vector<std::vector<uint8_t>> image_buffers;
+        json data;
+        try
+        {
+            data = parse_completion_request(body, image_buffers);
+        }
+        catch (const std::exception &)
+        {
+            conn.out += "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+            conn.finished = true;
+            return;
+        }
+        data["stream"] = true;
+
+        conn.task_id = llama->queue_tasks.get_new_id();
+        llama->queue_results.add_waiting_task_id(conn.task_id);
+        task_to_fd[conn.task_id] = conn.fd;
+        llama->request_completion(conn.task_id, std::move(data), false, false, -1, std::move(image_buffers));
+
+        conn.streaming = true;
+        conn.out += "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nCache-Control: no-cache\r\nConnection: close\r\n\r\n";
+    }
+
+    void handle_readable(int fd) {
+        auto it = conns.find(fd);
+        if (it == conns.end())
+        {
+            return;
+        }
+        connection &conn = it->second;
+
+        char buf[4096];
+        while (true)
+        {
+            const ssize_t n = recv(fd, buf, sizeof(buf), 0);
+            if (n > 0)
+            {
+                conn.in.append(buf, n);
+                continue;
+            }
+            if (n == 0)
+            {
+                close_connection(fd);
+                return;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                break;
+            }
+            close_connection(fd);
+            return;
+        }
+
+        if (conn.streaming || conn.finished)
+        {
+            return; // ignore anything after the request
+        }
 
-                        LOG_TEE("\nn_past_old = %d, n_past = %d, ga_i = %d\n\n", slot.n_past_se + bd, slot.n_past_se, slot.ga_i);
+        if (conn.header_end == std::string::npos)
+        {
+            conn.header_end = conn.in.find("\r\n\r\n");
+            if (conn.header_end != std::string::npos)
+            {
+                std::string headers = conn.in.substr(0, conn.header_end);
+                std::transform(headers.begin(), headers.end(), headers.begin(), ::tolower);
+                const size_t pos = headers.find("content-length:");
+                if (pos != std::string::npos)
+                {
+                    // parse without exceptions - a malformed value must not
+                    // take the whole server down
+                    const std::string value = headers.substr(pos + 15);
+                    char *end = nullptr;
+                    errno = 0;
+                    const long long length = strtoll(value.c_str(), &end, 10);
+                    if (errno != 0 || end == value.c_str() || length < 0)
+                    {
+                        conn.out += "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+                        conn.finished = true;
+                        update_events(conn);
+                        return;
                     }
-                    slot.n_past_se += n_tokens;
+                    conn.content_length = (size_t) length;
                 }
             }
+        }
 
-            llama_batch batch_view =
-            {
-                n_tokens,
-                batch.token    + i,
-                nullptr,
-                batch.pos      + i,
-                batch.n_seq_id + i,
-                batch.seq_id   + i,
-                batch.logits   + i,
-                0, 0, 0, // unused
-            };
+        // cap the buffered request - declared length first so huge uploads are
+        // refused before their body arrives, then the raw buffer for requests
+        // that never finish their headers
+        if (conn.in.size() > max_request_bytes ||
+            (conn.header_end != std::string::npos && conn.content_length > max_request_bytes))
+        {
+            conn.out += "HTTP/1.1 413 Payload Too Large\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+            conn.finished = true;
+            update_events(conn);
+            return;
+        }
 
-            const int ret = llama_decode(ctx, batch_view);
+        if (conn.header_end != std::string::npos &&
+            conn.in.size() >= conn.header_end + 4 + conn.content_length)
+        {
+            handle_request(conn);
+            update_events(conn);
+        }
+    }
 
-            if (ret != 0)
+    void handle_writable(int fd) {
+        auto it = conns.find(fd);
+        if (it == conns.end())
+        {
+            return;
+        }
+        connection &conn = it->second;
+
+        while (!conn.out.empty())
+        {
+            const ssize_t n = ::send(fd, conn.out.data(), conn.out.size(), MSG_NOSIGNAL);
+            if (n > 0)
             {
-                if (n_batch == 1 || ret < 0)
-                {
-                    // if you get here, it means the KV cache is full - try increasing it via the context size
-                    LOG_TEE("%s : failed to decode the batch, n_batch = %d, ret = %d\n", __func__, n_batch, ret);
-                    return false;
-                }
+                conn.out.erase(0, (size_t) n);
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                break;
+            }
+            close_connection(fd);
+            return;
+        }
 
-                LOG_TEE("%s : failed to find free space in the KV cache, retrying with smaller n_batch = %d\n", __func__, n_batch / 2);
+        if (conn.out.empty() && conn.finished)
+        {
+            close_connection(fd);
+            return;
+        }
 
-                // retry with half the batch size to try to find a free slot in the KV cache
-                n_batch /= 2;
-                i -= n_batch;
+        update_events(conn);
+    }
+
+    // pull finished results into the write buffers of their connections
+    void drain_results() {
+        std::vector<int> ready;
+        {
+            std::lock_guard<std::mutex> lock(mutex_ready);
+            ready.swap(ready_tasks);
+        }
+
+        for (const int task_id : ready)
+        {
+            auto it = task_to_fd.find(task_id);
+            if (it == task_to_fd.end())
+            {
                 continue;
             }
-
-            for (auto & slot : slots)
+            auto cit = conns.find(it->second);
+            if (cit == conns.end())
             {
-                if (slot.i_batch < (int) i || slot.i_batch >= (int) (i + n_tokens))
-                {
-                    continue;
-                }
+                continue;
+            }
+            connection &conn = cit->second;
 
-                // prompt evaluated for embedding
-                if (slot.embedding)
+            task_result result;
+            while (llama->queue_results.try_recv(task_id, result))
+            {
+                conn.out += (result.error ? "error: " : "data: ") +
+                            result.result_json.dump(-1, ' ', false, json::error_handler_t::replace) +
+                            "\n\n";
+                if (result.error || result.stop)
                 {
-                    send_embedding(slot, batch_view);
-                    slot.release();
-                    slot.i_batch = -1;
-                    continue;
+                    llama->queue_results.remove_waiting_task_id(task_id);
+                    task_to_fd.erase(task_id);
+                    conn.task_id  = -1;
+                    conn.finished = true;
+                    break;
                 }
+            }
 
-                completion_token_output result;
-                const llama_token id = llama_sampling_sample(slot.ctx_sampling, ctx, NULL, slot.i_batch - i);
+            handle_writable(conn.fd);
+        }
+    }
 
-                llama_sampling_accept(slot.ctx_sampling, ctx, id, true);
+    void run() {
+        epoll_event events[64];
+        while (running.load())
+        {
+            const int n = epoll_wait(fd_epoll, events, 64, 1000);
+            if (!running.load())
+            {
+                break;
+            }
 
-                slot.n_decoded += 1;
-                if (slot.n_decoded == 1)
+            for (int i = 0; i < n; ++i)
+            {
+                const int fd = events[i].data.fd;
+                if (fd == fd_listen)
                 {
-                    slot.t_start_genereration = ggml_time_us();
-                    slot.t_prompt_processing = (slot.t_start_genereration - slot.t_start_process_prompt) / 1e3;
-                    metrics.on_prompt_eval(slot);
-                }
+                    while (true)
+                    {
+                        const int fd_conn = accept(fd_listen, nullptr, nullptr);
+                        if (fd_conn < 0)
+                        {
+                            break;
+                        }
+                        if (!set_nonblocking(fd_conn))
+                        {
+                            close(fd_conn);
+                            continue;
+                        }
 
-                llama_token_data_array cur_p = { slot.ctx_sampling->cur.data(), slot.ctx_sampling->cur.size(), false };
-                result.tok = id;
+                        connection conn;
+                        conn.fd = fd_conn;
+                        conns.emplace(fd_conn, std::move(conn));
 
-                const int32_t n_probs = slot.sparams.n_probs;
-                if (slot.sparams.temp <= 0 && n_probs > 0)
+                        epoll_event ev = {};
+                        ev.events  = EPOLLIN;
+                        ev.data.fd = fd_conn;
+                        epoll_ctl(fd_epoll, EPOLL_CTL_ADD, fd_conn, &ev);
+                    }
+                }
+                else if (fd == fd_event)
                 {
-                    // for llama_sample_token_greedy we need to sort candidates
-                    llama_sample_softmax(ctx, &cur_p);
+                    uint64_t v;
+                    while (read(fd_event, &v, sizeof(v)) > 0) { }
+                    drain_results();
                 }
-
-                for (size_t i = 0; i < std::min(cur_p.size, (size_t)n_probs); ++i)
+                else if (events[i].events & (EPOLLHUP | EPOLLERR))
                 {
-                    result.probs.push_back({cur_p.data[i].id, cur_p.data[i].p});
+                    close_connection(fd);
                 }
-
-                if (!process_token(result, slot))
+                else
                 {
-                    slot.release();
-                    slot.print_timings();
-                    send_final_response(slot);
-                    metrics.on_prediction(slot);
+                    if (events[i].events & EPOLLIN)
+                    {
+                        handle_readable(fd);
+                    }
+                    if (events[i].events & EPOLLOUT)
+                    {
+                        handle_writable(fd);
+                    }
                 }
-
-                slot.i_batch = -1;
             }
         }
-
-        LOG_VERBOSE("slots updated", {});
-        return true;
-    }
-
-    json model_meta() {
-        return json{
-                {"vocab_type", llama_vocab_type(model)},
-                {"n_vocab", llama_n_vocab(model)},
-                {"n_ctx_train", llama_n_ctx_train(model)},
-                {"n_embd", llama_n_embd(model)},
-                {"n_params", llama_model_n_params(model)},
-                {"size", llama_model_size(model)},
-        };
     }
 };
+#endif // __linux__
 
 static void server_print_usage(const char *argv0, const gpt_params &params,
                                const server_params &sparams)
@@ -2061,6 +4280,13 @@ static void server_print_usage(const char *argv0, const gpt_params &params,
     printf("  --pooling {none,mean,cls}\n");
     printf("                        pooling type for embeddings, use model default if unspecified\n");
     printf("  -b N, --batch-size N      batch size for prompt processing (default: %d)\n", params.n_batch);
+    printf("  -pfc N, --prefill-chunk N max prompt tokens one slot may add per scheduling round, so long prompts\n");
+    printf("                            don't stall token generation of other slots (default: 0 = unlimited)\n");
+    printf("  --ctx-shift-discard F     fraction of the non-pinned window dropped per context shift (default: 0.5)\n");
+    printf("  --attention-sinks N       pin the first N tokens across context shifts, StreamingLLM style (default: 0 = disabled)\n");
+    printf("  --prefault-threads N      warm the model file's page cache with N reader threads before loading (default: 0 = disabled)\n");
+    printf("  --sse-port PORT           extra event-loop port for streaming completions, so idle SSE connections\n");
+    printf("                            don't pin HTTP pool threads - linux only (default: 0 = disabled)\n");
     printf("  --memory-f32              use f32 instead of f16 for memory key+value (default: disabled)\n");
     printf("                            not recommended: doubles context memory required and no measurable increase in quality\n");
     if (llama_supports_mlock())
@@ -2090,6 +4316,11 @@ static void server_print_usage(const char *argv0, const gpt_params &params,
     }
     printf("  -m FNAME, --model FNAME\n");
     printf("                            model path (default: %s)\n", params.model.c_str());
+    printf("  -md FNAME, --model-draft FNAME\n");
+    printf("                            draft model for speculative decoding (default: disabled)\n");
+    printf("  --draft N                 number of tokens to draft per speculative round (default: %d)\n", params.n_draft);
+    printf("  -me FNAME, --model-embedding FNAME\n");
+    printf("                            dedicated model for embedding requests, served from the same process (default: disabled)\n");
     printf("  -a ALIAS, --alias ALIAS\n");
     printf("                            set an alias for the model, will be added as `model` field in completion response\n");
     printf("  --lora FNAME              apply LoRA adapter (implies --no-mmap)\n");
@@ -2105,6 +4336,7 @@ static void server_print_usage(const char *argv0, const gpt_params &params,
     printf("  -cb, --cont-batching      enable continuous batching (a.k.a dynamic batching) (default: disabled)\n");
     printf("  -spf FNAME, --system-prompt-file FNAME\n");
     printf("                            set a file to load a system prompt (initial prompt of all slots), this is useful for chat applications.\n");
+    printf("  --kv-session-dir PATH     directory to persist per-conversation KV state of released slots (default: disabled)\n");
     printf("  -ctk TYPE, --cache-type-k TYPE\n");
     printf("                            KV cache data type for K (default: f16)\n");
     printf("  -ctv TYPE, --cache-type-v TYPE\n");
@@ -2367,6 +4599,56 @@ static void server_params_parse(int argc, char **argv, server_params &sparams,
             }
             params.n_batch = std::stoi(argv[i]);
         }
+        else if (arg == "--prefill-chunk" || arg == "-pfc")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            llama.n_prefill_chunk = std::stoi(argv[i]);
+        }
+        else if (arg == "--ctx-shift-discard")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            llama.ctx_shift_discard = std::stof(argv[i]);
+            if (llama.ctx_shift_discard <= 0.0f || llama.ctx_shift_discard > 1.0f)
+            {
+                invalid_param = true;
+                break;
+            }
+        }
+        else if (arg == "--attention-sinks")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            llama.n_attention_sinks = std::stoi(argv[i]);
+        }
+        else if (arg == "--prefault-threads")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            llama.n_prefault_threads = std::stoi(argv[i]);
+        }
+        else if (arg == "--sse-port")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            sparams.sse_port = std::stoi(argv[i]);
+        }
         else if (arg == "--gpu-layers" || arg == "-ngl" || arg == "--n-gpu-layers")
         {
             if (++i >= argc)
@@ -2453,6 +4735,33 @@ static void server_params_parse(int argc, char **argv, server_params &sparams,
             LOG_WARNING("llama.cpp was compiled without cuBLAS. It is not possible to set a main GPU.", {});
 #endif
         }
+        else if (arg == "-md" || arg == "--model-draft")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            params.model_draft = argv[i];
+        }
+        else if (arg == "-me" || arg == "--model-embedding")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            llama.model_embd_path = argv[i];
+        }
+        else if (arg == "--draft")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            params.n_draft = std::stoi(argv[i]);
+        }
         else if (arg == "--lora")
         {
             if (++i >= argc)
@@ -2561,6 +4870,15 @@ static void server_params_parse(int argc, char **argv, server_params &sparams,
             );
             llama.system_prompt_process(json::parse(systm_content));
         }
+        else if (arg == "--kv-session-dir")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            llama.kv_sessions.dir = argv[i];
+        }
         else if (arg == "-ctk" || arg == "--cache-type-k") {
             params.cache_type_k = argv[++i];
         }
@@ -2774,6 +5092,8 @@ inline void signal_handler(int signal) {
     shutdown_handler(signal);
 }
 
+// the benchmark harness (bench.cpp) includes this file with its own main
+#ifndef LLAMA_SERVER_MAIN_DISABLED
 #if defined(_WIN32)
 char* wchar_to_char(const wchar_t* wstr) {
     if (wstr == nullptr) return nullptr;
@@ -2808,6 +5128,9 @@ int main(int argc, char **argv) {
 
     server_params_parse(argc, argv, sparams, params, llama);
 
+    // logging goes through the background sink from here on
+    log_sink.start();
+
     if (params.model_alias == "unknown")
     {
         params.model_alias = params.model;
@@ -2844,21 +5167,18 @@ int main(int argc, char **argv) {
         server_state current_state = state.load();
         switch(current_state) {
             case SERVER_STATE_READY: {
-                // request slots data using task queue
-                task_server task;
-                task.id   = llama.queue_tasks.get_new_id();
-                task.type = TASK_TYPE_METRICS;
-                task.target_id = -1;
-
-                llama.queue_results.add_waiting_task_id(task.id);
-                llama.queue_tasks.post(task);
-
-                // get the result
-                task_result result = llama.queue_results.recv(task.id);
-                llama.queue_results.remove_waiting_task_id(task.id);
+                // read the published snapshot, no task queue round-trip
+                const std::vector<slot_snapshot> slots_snapshot = llama.read_slots_snapshot();
 
-                int n_idle_slots       = result.result_json["idle"];
-                int n_processing_slots = result.result_json["processing"];
+                int n_idle_slots       = 0;
+                int n_processing_slots = 0;
+                for (const slot_snapshot &snap : slots_snapshot) {
+                    if (snap.state == IDLE) {
+                        n_idle_slots++;
+                    } else {
+                        n_processing_slots++;
+                    }
+                }
 
                 json health = {
                         {"status",           "ok"},
@@ -2866,7 +5186,11 @@ int main(int argc, char **argv) {
                         {"slots_processing", n_processing_slots}};
                 res.status = 200; // HTTP OK
                 if (sparams.slots_endpoint && req.has_param("include_slots")) {
-                    health["slots"] = result.result_json["slots"];
+                    json slots_data = json::array();
+                    for (const slot_snapshot &snap : slots_snapshot) {
+                        slots_data.push_back(snap.to_json());
+                    }
+                    health["slots"] = slots_data;
                 }
 
                 if (n_idle_slots == 0) {
@@ -2891,20 +5215,13 @@ int main(int argc, char **argv) {
 
     if (sparams.slots_endpoint) {
         svr.Get("/slots", [&](const httplib::Request&, httplib::Response& res) {
-            // request slots data using task queue
-            task_server task;
-            task.id = llama.queue_tasks.get_new_id();
-            task.type = TASK_TYPE_METRICS;
-            task.target_id = -1;
-
-            llama.queue_results.add_waiting_task_id(task.id);
-            llama.queue_tasks.post(task);
-
-            // get the result
-            task_result result = llama.queue_results.recv(task.id);
-            llama.queue_results.remove_waiting_task_id(task.id);
+            // read the published snapshot, no task queue round-trip
+            json slots_data = json::array();
+            for (const slot_snapshot &snap : llama.read_slots_snapshot()) {
+                slots_data.push_back(snap.to_json());
+            }
 
-            res.set_content(result.result_json["slots"].dump(), "application/json");
+            res.set_content(slots_data.dump(), "application/json");
             res.status = 200; // HTTP OK
         });
     }
@@ -2944,6 +5261,22 @@ int main(int argc, char **argv) {
                             {"name",  "tokens_predicted_total"},
                             {"help",  "Number of generation tokens processed."},
                             {"value",  data["n_tokens_predicted_total"]}
+                    }, {
+                            {"name",  "kv_session_hits_total"},
+                            {"help",  "Number of prompts restored from the KV session store."},
+                            {"value",  data["n_kv_session_hits"]}
+                    }, {
+                            {"name",  "kv_session_misses_total"},
+                            {"help",  "Number of prompts that missed the KV session store."},
+                            {"value",  data["n_kv_session_misses"]}
+                    }, {
+                            {"name",  "grammar_cache_hits_total"},
+                            {"help",  "Number of requests reusing a previously parsed grammar."},
+                            {"value",  data["n_grammar_cache_hits"]}
+                    }, {
+                            {"name",  "grammar_cache_misses_total"},
+                            {"help",  "Number of grammars parsed for the first time."},
+                            {"value",  data["n_grammar_cache_misses"]}
                     }}},
                     {"gauge", {{
                             {"name",  "prompt_tokens_seconds"},
@@ -2986,6 +5319,12 @@ int main(int argc, char **argv) {
                 }
             }
 
+            // latency distributions, read straight from the atomic counters
+            llama.metrics.prompt_processing_hist.emit(prometheus, "prompt_processing_seconds",  "Prompt processing time per request.");
+            llama.metrics.inter_token_hist.emit(     prometheus, "inter_token_latency_seconds", "Time between consecutive generated tokens.");
+            llama.metrics.queue_wait_hist.emit(      prometheus, "queue_wait_seconds",          "Time from task post to slot assignment.");
+            llama.metrics.first_token_hist.emit(     prometheus, "time_to_first_token_seconds", "Time from task post to the first generated token.");
+
             res.set_content(prometheus.str(), "text/plain; version=0.0.4");
             res.status = 200; // HTTP OK
         });
@@ -3110,11 +5449,13 @@ int main(int argc, char **argv) {
                 if (!validate_api_key(req, res)) {
                     return;
                 }
-                json data = json::parse(req.body);
+                std::vector<std::vector<uint8_t>> image_buffers;
+                json data = parse_completion_request(req.body, image_buffers);
+                const bool stream = json_value(data, "stream", false);
                 const int task_id = llama.queue_tasks.get_new_id();
                 llama.queue_results.add_waiting_task_id(task_id);
-                llama.request_completion(task_id, data, false, false, -1);
-                if (!json_value(data, "stream", false)) {
+                llama.request_completion(task_id, std::move(data), false, false, -1, std::move(image_buffers));
+                if (!stream) {
                     std::string completion_text;
                     task_result result = llama.queue_results.recv(task_id);
                     if (!result.error && result.stop) {
@@ -3131,7 +5472,21 @@ int main(int argc, char **argv) {
                     {
                         while (true)
                         {
-                            task_result result = llama.queue_results.recv(task_id);
+                            task_result result;
+                            if (!llama.queue_results.recv_with_timeout(task_id, 300, result))
+                            {
+                                // no token yet - check the client is still there, so a
+                                // dropped connection stops the generation promptly
+                                // instead of on the next failed write
+                                if (!sink.is_writable())
+                                {
+                                    LOG_VERBOSE("connection closed, cancelling task", {{"task_id", task_id}});
+                                    llama.request_cancel(task_id);
+                                    llama.queue_results.remove_waiting_task_id(task_id);
+                                    return false;
+                                }
+                                continue;
+                            }
                             if (!result.error) {
                                 const std::string str =
                                     "data: " +
@@ -3181,6 +5536,22 @@ int main(int argc, char **argv) {
                 }
             });
 
+    svr.Post("/upload-image", [&llama](const httplib::Request &req, httplib::Response &res)
+            {
+                res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
+                if (req.body.empty())
+                {
+                    res.status = 400;
+                    return res.set_content(R"({"error": "empty image body"})", "application/json; charset=utf-8");
+                }
+                // raw octet-stream body - large images skip base64 and JSON
+                // entirely; reference the returned id from image_data via
+                // {"upload_id": "..."}
+                const std::string id = llama.store_uploaded_image(req.body);
+                const json data = {{"upload_id", id}, {"size", req.body.size()}};
+                return res.set_content(data.dump(), "application/json; charset=utf-8");
+            });
+
     svr.Post("/tokenize", [&llama](const httplib::Request &req, httplib::Response &res)
             {
                 res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
@@ -3217,6 +5588,15 @@ int main(int argc, char **argv) {
                 if (body.count("content") != 0)
                 {
                     prompt = body["content"];
+
+                    // a singleton array would otherwise be treated as a multi-part
+                    // prompt by tokenize() - unwrap it so it embeds as one input.
+                    // larger arrays are split into one sequence per input and the
+                    // embeddings come back in input order
+                    if (prompt.is_array() && prompt.size() == 1)
+                    {
+                        prompt = prompt[0];
+                    }
                 }
                 else
                 {
@@ -3291,6 +5671,23 @@ int main(int argc, char **argv) {
         std::placeholders::_3
     ));
 
+#if defined(__linux__)
+    server_event_loop sse_loop;
+    if (sparams.sse_port > 0)
+    {
+        sse_loop.api_keys = sparams.api_keys;
+        if (!sse_loop.start(llama, sparams.hostname, sparams.sse_port))
+        {
+            return 1;
+        }
+    }
+#else
+    if (sparams.sse_port > 0)
+    {
+        LOG_WARNING("--sse-port is only supported on linux, ignoring", {});
+    }
+#endif
+
     shutdown_handler = [&](int) {
         llama.queue_tasks.terminate();
     };
@@ -3313,9 +5710,14 @@ int main(int argc, char **argv) {
     delete[] argv;
 #endif
     llama.queue_tasks.start_loop();
+#if defined(__linux__)
+    sse_loop.stop();
+#endif
     svr.stop();
     t.join();
 
     llama_backend_free();
+    log_sink.stop();
     return 0;
 }
+#endif // LLAMA_SERVER_MAIN_DISABLED
@@ -25,8 +25,15 @@
 #include <string>
 #include <vector>
 #include <set>
+#include <atomic>
+#include <deque>
+#include <iterator>
+#include <memory>
 #include <mutex>
+#include <thread>
+#include <chrono>
 #include <condition_variable>
+#include <functional>
 #include <unordered_map>
 
 #include "json.hpp"
@@ -77,6 +84,11 @@ struct task_server {
     int target_id;
     task_type type;
     json data;
+    // image bytes extracted out of the DOM by the streaming request parser,
+    // referenced from image_data entries via "buffer_index"
+    std::vector<std::vector<uint8_t>> image_buffers;
+    int64_t t_posted = 0; // when the task entered the queue, for wait metrics
+    int priority = 0;     // higher outranks lower; may preempt a running slot
     bool infill_mode = false;
     bool embedding_mode = false;
     int multitask_id = -1;
@@ -115,6 +127,92 @@ struct token_translator {
     std::string operator()(const completion_token_output &cto) const { return (*this)(cto.tok); }
 };
 
+// bounded queue of formatted log lines drained to stdout by a background
+// thread. hot threads only move a string under a short lock; when the queue
+// is full the line is dropped and accounted for, so the inference loop never
+// blocks on I/O. before start() / after stop(), writes fall back to
+// synchronous stdout
+struct server_log_sink {
+    size_t capacity = 4096;
+
+    std::deque<std::string> lines;
+    uint64_t n_dropped = 0;
+
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::thread worker;
+    bool running = false;
+
+    void start() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            running = true;
+        }
+        worker = std::thread([this]() { run(); });
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!running) {
+                return;
+            }
+            running = false;
+        }
+        condition.notify_all();
+        worker.join();
+    }
+
+    // returns false when the sink is not running and the caller should write
+    // the line itself
+    bool push(std::string && line) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!running) {
+                return false;
+            }
+            if (lines.size() >= capacity) {
+                n_dropped++;
+                return true;
+            }
+            lines.push_back(std::move(line));
+        }
+        condition.notify_one();
+        return true;
+    }
+
+    void run() {
+        std::vector<std::string> batch;
+        while (true) {
+            uint64_t dropped = 0;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                condition.wait(lock, [this]() { return !lines.empty() || !running; });
+                if (lines.empty() && !running) {
+                    break;
+                }
+                while (!lines.empty()) {
+                    batch.push_back(std::move(lines.front()));
+                    lines.pop_front();
+                }
+                dropped   = n_dropped;
+                n_dropped = 0;
+            }
+
+            for (const std::string & line : batch) {
+                fwrite(line.data(), 1, line.size(), stdout);
+            }
+            if (dropped > 0) {
+                fprintf(stdout, "WARN [server_log_sink] dropped %llu log lines\n", (unsigned long long) dropped);
+            }
+            fflush(stdout);
+            batch.clear();
+        }
+    }
+};
+
+static server_log_sink log_sink;
+
 static inline void server_log(const char *level, const char *function, int line, const char *message, const nlohmann::ordered_json &extra) {
     std::stringstream ss_tid;
     ss_tid << std::this_thread::get_id();
@@ -135,7 +233,11 @@ static inline void server_log(const char *level, const char *function, int line,
             log.merge_patch(extra);
         }
 
-        std::cout << log.dump(-1, ' ', false, json::error_handler_t::replace) << "\n" << std::flush;
+        std::string str = log.dump(-1, ' ', false, json::error_handler_t::replace);
+        str += "\n";
+        if (!log_sink.push(std::move(str))) {
+            std::cout << str << std::flush;
+        }
     } else {
         char buf[1024];
         snprintf(buf, 1024, "%4s [%24s] %s", level, function, message);
@@ -151,9 +253,12 @@ static inline void server_log(const char *level, const char *function, int line,
             ss << " " << el.key() << "=" << value;
         }
 
-        const std::string str = ss.str();
-        printf("%.*s\n", (int)str.size(), str.data());
-        fflush(stdout);
+        std::string str = ss.str();
+        str += "\n";
+        if (!log_sink.push(std::move(str))) {
+            printf("%.*s", (int)str.size(), str.data());
+            fflush(stdout);
+        }
     }
 }
 
@@ -215,42 +320,89 @@ inline std::string format_chat(const struct llama_model * model, const std::stri
 // work queue utils
 //
 
+// Multi-producer single-consumer task queue. Producers (the httplib worker
+// threads) push onto an intrusive lock-free stack; the inference thread
+// drains the stack in one exchange and restores FIFO order locally, so a
+// post() is a single CAS and a pop never touches a shared lock. A mutex and
+// condition variable are only used to park the consumer when idle.
 struct llama_server_queue {
-    int id = 0;
-    std::mutex mutex_tasks;
-    bool running;
-    // queues
-    std::vector<task_server> queue_tasks;
+    struct task_node {
+        task_server task;
+        task_node *next = nullptr;
+    };
+
+    std::atomic<int> id{0};
+    std::atomic<bool> running{false};
+
+    // incoming tasks, newest first
+    std::atomic<task_node *> queue_head{nullptr};
+
+    // only touched by the consumer thread
     std::vector<task_server> queue_tasks_deferred;
+
     std::vector<task_multi> queue_multitasks;
+    std::mutex mutex_multitasks;
+
+    // consumer wait strategy: producers only take the mutex when the
+    // consumer advertised that it is (about to go) sleeping
+    std::mutex mutex_sleep;
     std::condition_variable condition_tasks;
-    // callback functions
-    std::function<void(task_server&)> callback_new_task;
-    std::function<void(task_multi&)> callback_finish_multitask;
-    std::function<void(void)> callback_run_slots;
+    std::atomic<bool> sleeping{false};
+
+    ~llama_server_queue() {
+        task_node *node = queue_head.exchange(nullptr);
+        while (node != nullptr) {
+            task_node *next = node->next;
+            delete node;
+            node = next;
+        }
+    }
 
     // Add a new task to the end of the queue
     int post(task_server task) {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
         if (task.id == -1) {
-            task.id = id++;
+            task.id = id.fetch_add(1, std::memory_order_relaxed);
             LOG_VERBOSE("new task id", {{"new_id", task.id}});
         }
-        queue_tasks.push_back(std::move(task));
-        condition_tasks.notify_one();
-        return task.id;
+        if (task.t_posted == 0) {
+            task.t_posted = ggml_time_us();
+        }
+        const int task_id = task.id;
+
+        task_node *node = new task_node();
+        node->task = std::move(task);
+        node->next = queue_head.load(std::memory_order_relaxed);
+        // the push and the sleeping check must be seq_cst (as must the
+        // consumer's sleeping store and queue_head check): with weaker
+        // orders both sides can reorder their store before the other's
+        // load, the producer skips the notify and the consumer sleeps on
+        // a non-empty queue
+        while (!queue_head.compare_exchange_weak(node->next, node,
+                    std::memory_order_seq_cst, std::memory_order_relaxed)) {
+        }
+
+        if (sleeping.load(std::memory_order_seq_cst)) {
+            std::lock_guard<std::mutex> lock(mutex_sleep);
+            condition_tasks.notify_one();
+        }
+        return task_id;
     }
 
-    // Add a new task, but defer until one slot is available
+    // Add a new task, but defer until one slot is available.
+    // Kept ordered by priority (stable within a class), so high-priority
+    // work re-enters the queue first when a slot frees.
+    // Only called from the consumer thread.
     void defer(task_server task) {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        queue_tasks_deferred.push_back(std::move(task));
+        auto it = queue_tasks_deferred.begin();
+        while (it != queue_tasks_deferred.end() && it->priority >= task.priority) {
+            ++it;
+        }
+        queue_tasks_deferred.insert(it, std::move(task));
     }
 
     // Get the next id for creating anew task
     int get_new_id() {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        int new_id = id++;
+        int new_id = id.fetch_add(1, std::memory_order_relaxed);
         LOG_VERBOSE("new task id", {{"new_id", new_id}});
         return new_id;
     }
@@ -270,22 +422,20 @@ struct llama_server_queue {
         callback_run_slots = callback;
     }
 
-    // Call when the state of one slot is changed
+    // Call when the state of one slot is changed.
+    // Only called from the consumer thread.
     void notify_slot_changed() {
-        // move deferred tasks back to main loop
-        std::unique_lock<std::mutex> lock(mutex_tasks);
+        // repost deferred tasks so the next drain picks them up
         for (auto & task : queue_tasks_deferred) {
-            queue_tasks.push_back(std::move(task));
+            post(std::move(task));
         }
         queue_tasks_deferred.clear();
     }
 
     // end the start_loop routine
     void terminate() {
-        {
-            std::unique_lock<std::mutex> lock(mutex_tasks);
-            running = false;
-        }
+        running.store(false, std::memory_order_release);
+        std::lock_guard<std::mutex> lock(mutex_sleep);
         condition_tasks.notify_all();
     }
 
@@ -297,32 +447,41 @@ struct llama_server_queue {
      * - Run all slots
      */
     void start_loop() {
-        running = true;
+        running.store(true, std::memory_order_release);
         while (true) {
             LOG_VERBOSE("new task may arrive", {});
+
+            // grab everything posted so far in a single exchange and
+            // reverse the stack to restore FIFO order
+            task_node *node = queue_head.exchange(nullptr, std::memory_order_acquire);
+            task_node *fifo = nullptr;
+            while (node != nullptr) {
+                task_node *next = node->next;
+                node->next = fifo;
+                fifo = node;
+                node = next;
+            }
+
+            while (fifo != nullptr) {
+                task_node *next = fifo->next;
+                task_server task = std::move(fifo->task);
+                delete fifo;
+                fifo = next;
+                LOG_VERBOSE("callback_new_task", {{"task_id", task.id}});
+                callback_new_task(task);
+            }
+
+            LOG_VERBOSE("update_multitasks", {});
+            // check if we have any finished multitasks
             {
-                while (true)
-                {
-                    std::unique_lock<std::mutex> lock(mutex_tasks);
-                    if (queue_tasks.empty()) {
-                        lock.unlock();
-                        break;
-                    }
-                    task_server task = queue_tasks.front();
-                    queue_tasks.erase(queue_tasks.begin());
-                    lock.unlock();
-                    LOG_VERBOSE("callback_new_task", {{"task_id", task.id}});
-                    callback_new_task(task);
-                }
-                LOG_VERBOSE("update_multitasks", {});
-                // check if we have any finished multitasks
+                std::lock_guard<std::mutex> lock(mutex_multitasks);
                 auto queue_iterator = queue_multitasks.begin();
                 while (queue_iterator != queue_multitasks.end())
                 {
                     if (queue_iterator->subtasks_remaining.empty())
                     {
                         // all subtasks done == multitask is done
-                        task_multi current_multitask = *queue_iterator;
+                        task_multi current_multitask = std::move(*queue_iterator);
                         callback_finish_multitask(current_multitask);
                         // remove this multitask
                         queue_iterator = queue_multitasks.erase(queue_iterator);
@@ -332,22 +491,25 @@ struct llama_server_queue {
                         ++queue_iterator;
                     }
                 }
-                // all tasks in the current loop is processed, slots data is now ready
-                LOG_VERBOSE("callback_run_slots", {});
-                callback_run_slots();
             }
+            // all tasks in the current loop is processed, slots data is now ready
+            LOG_VERBOSE("callback_run_slots", {});
+            callback_run_slots();
+
             LOG_VERBOSE("wait for new task", {});
             // wait for new task
             {
-                std::unique_lock<std::mutex> lock(mutex_tasks);
-                if (queue_tasks.empty()) {
-                    if (!running) {
-                        LOG_VERBOSE("ending start_loop", {});
-                        return;
-                    }
-                    condition_tasks.wait(lock, [&]{
-                        return (!queue_tasks.empty() || !running);
-                    });
+                std::unique_lock<std::mutex> lock(mutex_sleep);
+                sleeping.store(true, std::memory_order_seq_cst);
+                condition_tasks.wait(lock, [&]{
+                    return queue_head.load(std::memory_order_seq_cst) != nullptr ||
+                           !running.load(std::memory_order_acquire);
+                });
+                sleeping.store(false, std::memory_order_release);
+                if (!running.load(std::memory_order_acquire) &&
+                     queue_head.load(std::memory_order_acquire) == nullptr) {
+                    LOG_VERBOSE("ending start_loop", {});
+                    return;
                 }
             }
         }
@@ -360,74 +522,131 @@ struct llama_server_queue {
     // add a multitask by specifying the id of all subtask (subtask is a task_server)
     void add_multitask(int multitask_id, std::vector<int>& sub_ids)
     {
-        std::lock_guard<std::mutex> lock(mutex_tasks);
+        std::lock_guard<std::mutex> lock(mutex_multitasks);
         task_multi multi;
         multi.id = multitask_id;
         std::copy(sub_ids.begin(), sub_ids.end(), std::inserter(multi.subtasks_remaining, multi.subtasks_remaining.end()));
-        queue_multitasks.push_back(multi);
+        queue_multitasks.push_back(std::move(multi));
     }
 
-    // updatethe remaining subtasks, while appending results to multitask
+    // updatethe remaining subtasks, while appending results to multitask.
+    // the result is consumed - send() hands it over and does not touch it again
     void update_multitask(int multitask_id, int subtask_id, task_result& result)
     {
-        std::lock_guard<std::mutex> lock(mutex_tasks);
+        std::lock_guard<std::mutex> lock(mutex_multitasks);
         for (auto& multitask : queue_multitasks)
         {
             if (multitask.id == multitask_id)
             {
                 multitask.subtasks_remaining.erase(subtask_id);
-                multitask.results.push_back(result);
+                multitask.results.push_back(std::move(result));
             }
         }
     }
+
+private:
+    // callback functions
+    std::function<void(task_server&)> callback_new_task;
+    std::function<void(task_multi&)> callback_finish_multitask;
+    std::function<void(void)> callback_run_slots;
 };
 
 struct llama_server_response {
     typedef std::function<void(int, int, task_result&)> callback_multitask_t;
     callback_multitask_t callback_update_multitask;
-    // for keeping track of all tasks waiting for the result
-    std::set<int> waiting_task_ids;
-    // the main result queue
-    std::vector<task_result> queue_results;
-    std::mutex mutex_results;
-    std::condition_variable condition_results;
+
+    // single-consumer result slot for one waiting task: results are delivered
+    // straight to the owner, which waits on its own condition variable, so
+    // send() is O(1) and only the owning HTTP thread is woken
+    struct mailbox {
+        std::mutex mutex;
+        std::condition_variable condition;
+        std::vector<task_result> results;
+    };
+
+    // task_id -> mailbox of the thread waiting for its results.
+    // the map is guarded by mutex_mailboxes; shared_ptr keeps a mailbox
+    // alive if its owner is removed while a send() is in flight
+    std::unordered_map<int, std::shared_ptr<mailbox>> mailboxes;
+    std::mutex mutex_mailboxes;
 
     // add the task_id to the list of tasks waiting for response
     void add_waiting_task_id(int task_id) {
         LOG_VERBOSE("waiting for task id", {{"task_id", task_id}});
-        std::unique_lock<std::mutex> lock(mutex_results);
-        waiting_task_ids.insert(task_id);
+        std::lock_guard<std::mutex> lock(mutex_mailboxes);
+        if (mailboxes.count(task_id) == 0) {
+            mailboxes.emplace(task_id, std::make_shared<mailbox>());
+        }
     }
 
     // when the request is finished, we can remove task associated with it
     void remove_waiting_task_id(int task_id) {
         LOG_VERBOSE("remove waiting for task id", {{"task_id", task_id}});
-        std::unique_lock<std::mutex> lock(mutex_results);
-        waiting_task_ids.erase(task_id);
+        std::lock_guard<std::mutex> lock(mutex_mailboxes);
+        mailboxes.erase(task_id);
+    }
+
+    std::shared_ptr<mailbox> find_mailbox(int task_id) {
+        std::lock_guard<std::mutex> lock(mutex_mailboxes);
+        auto it = mailboxes.find(task_id);
+        return it == mailboxes.end() ? nullptr : it->second;
+    }
+
+    // optional hook invoked after a result lands in a mailbox - the event-loop
+    // front end uses it to wake its epoll thread instead of blocking in recv().
+    // must be set before serving starts
+    std::function<void(int)> callback_result_ready;
+
+    // non-blocking receive for event-driven consumers
+    bool try_recv(int task_id, task_result &result) {
+        std::shared_ptr<mailbox> box = find_mailbox(task_id);
+        if (box == nullptr) {
+            return false;
+        }
+
+        std::lock_guard<std::mutex> lock(box->mutex);
+        if (box->results.empty()) {
+            return false;
+        }
+
+        result = std::move(box->results.front());
+        box->results.erase(box->results.begin());
+        return true;
+    }
+
+    // like recv(), but gives up after timeout_ms so the caller can check the
+    // connection for liveness between tokens; returns false on timeout
+    bool recv_with_timeout(int task_id, int timeout_ms, task_result &result) {
+        std::shared_ptr<mailbox> box = find_mailbox(task_id);
+        assert(box != nullptr && "recv_with_timeout() without add_waiting_task_id()");
+
+        std::unique_lock<std::mutex> lock(box->mutex);
+        if (!box->condition.wait_for(lock, std::chrono::milliseconds(timeout_ms), [&]{
+            return !box->results.empty();
+        })) {
+            return false;
+        }
+
+        result = std::move(box->results.front());
+        box->results.erase(box->results.begin());
+        assert(result.multitask_id == -1);
+        return true;
     }
 
     // This function blocks the thread until there is a response for this task_id
     task_result recv(int task_id) {
-        while (true)
-        {
-            std::unique_lock<std::mutex> lock(mutex_results);
-            condition_results.wait(lock, [&]{
-                return !queue_results.empty();
-            });
+        std::shared_ptr<mailbox> box = find_mailbox(task_id);
+        assert(box != nullptr && "recv() without add_waiting_task_id()");
 
-            for (int i = 0; i < (int) queue_results.size(); i++)
-            {
-                if (queue_results[i].id == task_id)
-                {
-                    assert(queue_results[i].multitask_id == -1);
-                    task_result res = queue_results[i];
-                    queue_results.erase(queue_results.begin() + i);
-                    return res;
-                }
-            }
-        }
+        std::unique_lock<std::mutex> lock(box->mutex);
+        box->condition.wait(lock, [&]{
+            return !box->results.empty();
+        });
 
-        // should never reach here
+        task_result res = std::move(box->results.front());
+        box->results.erase(box->results.begin());
+        assert(res.multitask_id == -1);
+        return res;
     }
 
     // Register the function to update multitask
@@ -437,25 +656,31 @@ struct llama_server_response {
 
     // Send a new result to a waiting task_id
     void send(task_result result) {
-        std::unique_lock<std::mutex> lock(mutex_results);
         LOG_VERBOSE("send new result", {{"task_id", result.id}});
-        for (auto& task_id : waiting_task_ids) {
-            // LOG_TEE("waiting task id %i \n", task_id);
-            // for now, tasks that have associated parent multitasks just get erased once multitask picks up the result
-            if (result.multitask_id == task_id)
-            {
-                LOG_VERBOSE("callback_update_multitask", {{"task_id", task_id}});
-                callback_update_multitask(task_id, result.id, result);
-                continue;
-            }
 
-            if (result.id == task_id)
-            {
-                LOG_VERBOSE("queue_results.push_back", {{"task_id", task_id}});
-                queue_results.push_back(result);
-                condition_results.notify_all();
-                return;
-            }
+        // results belonging to a multitask are aggregated by the queue
+        // instead of being delivered to a mailbox
+        if (result.multitask_id != -1 && find_mailbox(result.multitask_id) != nullptr) {
+            LOG_VERBOSE("callback_update_multitask", {{"task_id", result.multitask_id}});
+            callback_update_multitask(result.multitask_id, result.id, result);
+            return;
+        }
+
+        std::shared_ptr<mailbox> box = find_mailbox(result.id);
+        if (box == nullptr) {
+            // no one is waiting (e.g. the client disconnected) - drop the result
+            return;
+        }
+
+        const int task_id = result.id;
+        {
+            std::lock_guard<std::mutex> lock(box->mutex);
+            box->results.push_back(std::move(result));
+        }
+        box->condition.notify_one();
+
+        if (callback_result_ready) {
+            callback_result_ready(task_id);
         }
     }
 };
@@ -469,69 +694,171 @@ static const std::string base64_chars =
              "abcdefghijklmnopqrstuvwxyz"
              "0123456789+/";
 
-static inline bool is_base64(uint8_t c)
-{
-    return (isalnum(c) || (c == '+') || (c == '/'));
-}
-
+// table-driven decoder: one lookup per input byte and a preallocated output,
+// instead of std::string::find on the alphabet and per-byte push_back
 static inline std::vector<uint8_t> base64_decode(const std::string & encoded_string)
 {
-    int i = 0;
-    int j = 0;
-    int in_ = 0;
-
-    int in_len = encoded_string.size();
-
-    uint8_t char_array_4[4];
-    uint8_t char_array_3[3];
+    // inverse alphabet, 0xff marks bytes outside the alphabet
+    static const std::vector<uint8_t> base64_inv = []()
+    {
+        std::vector<uint8_t> table(256, 0xff);
+        for (size_t i = 0; i < base64_chars.size(); i++)
+        {
+            table[(uint8_t) base64_chars[i]] = (uint8_t) i;
+        }
+        return table;
+    }();
 
     std::vector<uint8_t> ret;
+    ret.reserve((encoded_string.size() / 4) * 3 + 2);
+
+    uint32_t group  = 0;
+    int      n_vals = 0;
 
-    while (in_len-- && (encoded_string[in_] != '=') && is_base64(encoded_string[in_]))
+    for (const char c : encoded_string)
     {
-        char_array_4[i++] = encoded_string[in_]; in_++;
-        if (i == 4)
+        const uint8_t val = base64_inv[(uint8_t) c];
+        if (val == 0xff)
         {
-            for (i = 0; i <4; i++)
-            {
-                char_array_4[i] = base64_chars.find(char_array_4[i]);
-            }
+            break; // padding or a byte outside the alphabet ends the data
+        }
 
-            char_array_3[0] = ((char_array_4[0]      ) << 2) + ((char_array_4[1] & 0x30) >> 4);
-            char_array_3[1] = ((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2);
-            char_array_3[2] = ((char_array_4[2] & 0x3) << 6) +   char_array_4[3];
+        group = (group << 6) | val;
+        if (++n_vals == 4)
+        {
+            ret.push_back((group >> 16) & 0xff);
+            ret.push_back((group >>  8) & 0xff);
+            ret.push_back( group        & 0xff);
+            group  = 0;
+            n_vals = 0;
+        }
+    }
 
-            for (i = 0; (i < 3); i++)
-            {
-                ret.push_back(char_array_3[i]);
-            }
-            i = 0;
+    // 2 or 3 trailing values decode to 1 or 2 bytes
+    if (n_vals >= 2)
+    {
+        group <<= 6 * (4 - n_vals);
+        ret.push_back((group >> 16) & 0xff);
+        if (n_vals == 3)
+        {
+            ret.push_back((group >> 8) & 0xff);
         }
     }
 
-    if (i)
+    return ret;
+}
+
+//
+// streaming request parsing
+//
+
+// SAX handler that builds the usual DOM for a request body but diverts
+// image_data[i].data blobs: the base64 payload is decoded straight into
+// `image_buffers` and the entry keeps a small {"buffer_index": n} marker
+// instead, so a multi-megabyte image never exists as a DOM string
+struct completion_request_sax : nlohmann::json_sax<json>
+{
+    json root;
+    std::vector<std::vector<uint8_t>> & image_buffers;
+
+    std::vector<json *> stack; // currently open containers
+    std::string cur_key;
+    json * image_data_array = nullptr;
+    bool failed = false;
+
+    completion_request_sax(std::vector<std::vector<uint8_t>> & image_buffers)
+        : image_buffers(image_buffers) {}
+
+    json & append(json && value)
     {
-        for (j = i; j <4; j++)
+        if (stack.empty())
+        {
+            root = std::move(value);
+            return root;
+        }
+        json & top = *stack.back();
+        if (top.is_object())
         {
-            char_array_4[j] = 0;
+            return top[cur_key] = std::move(value);
         }
+        top.push_back(std::move(value));
+        return top.back();
+    }
 
-        for (j = 0; j <4; j++)
+    bool null() override                                             { append(nullptr);  return true; }
+    bool boolean(bool val) override                                  { append(val);      return true; }
+    bool number_integer(number_integer_t val) override               { append(val);      return true; }
+    bool number_unsigned(number_unsigned_t val) override             { append(val);      return true; }
+    bool number_float(number_float_t val, const string_t &) override { append(val);      return true; }
+    bool binary(binary_t & val) override                             { append(json(val)); return true; }
+
+    bool string(string_t & val) override
+    {
+        // the "data" field of an image_data element - decode it out of band
+        if (cur_key == "data" && stack.size() >= 2 &&
+            stack.back()->is_object() && stack[stack.size() - 2] == image_data_array)
         {
-            char_array_4[j] = base64_chars.find(char_array_4[j]);
+            image_buffers.push_back(base64_decode(val));
+            (*stack.back())["buffer_index"] = image_buffers.size() - 1;
+            return true;
         }
+        append(std::move(val));
+        return true;
+    }
+
+    bool key(string_t & val) override
+    {
+        cur_key = std::move(val);
+        return true;
+    }
 
-        char_array_3[0] = ((char_array_4[0]      ) << 2) + ((char_array_4[1] & 0x30) >> 4);
-        char_array_3[1] = ((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2);
-        char_array_3[2] = ((char_array_4[2] & 0x3) << 6) +   char_array_4[3];
+    bool start_object(std::size_t) override
+    {
+        json & obj = append(json::object());
+        stack.push_back(&obj);
+        return true;
+    }
 
-        for (j = 0; (j < i - 1); j++)
+    bool end_object() override
+    {
+        stack.pop_back();
+        return true;
+    }
+
+    bool start_array(std::size_t) override
+    {
+        json & arr = append(json::array());
+        if (stack.size() == 1 && cur_key == "image_data")
         {
-            ret.push_back(char_array_3[j]);
+            image_data_array = &arr;
         }
+        stack.push_back(&arr);
+        return true;
     }
 
-    return ret;
+    bool end_array() override
+    {
+        stack.pop_back();
+        return true;
+    }
+
+    bool parse_error(std::size_t, const std::string &, const nlohmann::detail::exception &) override
+    {
+        failed = true;
+        return false;
+    }
+};
+
+static json parse_completion_request(const std::string & body, std::vector<std::vector<uint8_t>> & image_buffers)
+{
+    completion_request_sax handler(image_buffers);
+    if (!json::sax_parse(body, &handler) || handler.failed)
+    {
+        // reparse so the caller sees the usual nlohmann error
+        image_buffers.clear();
+        return json::parse(body);
+    }
+    return std::move(handler.root);
 }
 
 //
@@ -561,6 +888,206 @@ static std::string gen_chatcmplid()
     return chatcmplid.str();
 }
 
+//
+// incremental stop-sequence matching
+//
+
+// Aho-Corasick automaton over the stop strings of one request. The inference
+// thread advances it with just the bytes of each newly generated token,
+// replacing the per-token rescans of the accumulated generated text. The
+// current node depth doubles as the length of a partial match (a suffix of
+// the stream that is a prefix of some stop string).
+struct stop_string_matcher {
+    struct node {
+        std::unordered_map<unsigned char, int> next;
+        int fail      = 0;
+        int match_len = 0; // longest stop string ending at this node (0 = none)
+        int depth     = 0;
+    };
+
+    std::vector<node> nodes;
+    int state    = 0;
+    size_t n_fed = 0; // total bytes fed so far
+
+    // first full match seen since the last reset
+    size_t match_pos = std::string::npos; // byte offset of the match start
+    int    match_len = 0;
+
+    bool empty() const {
+        return nodes.size() <= 1;
+    }
+
+    void build(const std::vector<std::string> & patterns) {
+        nodes.clear();
+        nodes.emplace_back();
+        reset();
+
+        for (const std::string & pat : patterns) {
+            int cur = 0;
+            for (const char ch : pat) {
+                const unsigned char c = ch;
+                auto it = nodes[cur].next.find(c);
+                if (it == nodes[cur].next.end()) {
+                    nodes.emplace_back();
+                    nodes.back().depth = nodes[cur].depth + 1;
+                    it = nodes[cur].next.emplace(c, (int) nodes.size() - 1).first;
+                }
+                cur = it->second;
+            }
+            if (cur != 0) {
+                nodes[cur].match_len = std::max(nodes[cur].match_len, (int) pat.size());
+            }
+        }
+
+        // breadth-first construction of the failure links
+        std::vector<int> queue;
+        for (const auto & kv : nodes[0].next) {
+            queue.push_back(kv.second);
+        }
+        for (size_t head = 0; head < queue.size(); head++) {
+            const int v = queue[head];
+            for (const auto & kv : nodes[v].next) {
+                int f = nodes[v].fail;
+                while (f != 0 && nodes[f].next.count(kv.first) == 0) {
+                    f = nodes[f].fail;
+                }
+                auto it = nodes[f].next.find(kv.first);
+                const int fail = (it != nodes[f].next.end() && it->second != kv.second) ? it->second : 0;
+                nodes[kv.second].fail = fail;
+                // inherit matches reachable through the failure chain
+                nodes[kv.second].match_len = std::max(nodes[kv.second].match_len, nodes[fail].match_len);
+                queue.push_back(kv.second);
+            }
+        }
+    }
+
+    void reset() {
+        state     = 0;
+        n_fed     = 0;
+        match_pos = std::string::npos;
+        match_len = 0;
+    }
+
+    // feed one byte, recording the first full match
+    void push(unsigned char c) {
+        while (state != 0 && nodes[state].next.count(c) == 0) {
+            state = nodes[state].fail;
+        }
+        auto it = nodes[state].next.find(c);
+        state = it == nodes[state].next.end() ? 0 : it->second;
+        n_fed++;
+
+        if (nodes[state].match_len > 0 && match_pos == std::string::npos) {
+            match_len = nodes[state].match_len;
+            match_pos = n_fed - match_len;
+        }
+    }
+
+    void push(const std::string & bytes) {
+        for (const char c : bytes) {
+            push((unsigned char) c);
+        }
+    }
+
+    // length of the current partial match at the end of the stream
+    int partial_len() const {
+        return nodes[state].depth;
+    }
+};
+
+//
+// token prefix index
+//
+
+// Trie over token IDs mapping prompt prefixes to the slots whose KV cache
+// currently holds them. Lets a slot that is about to process a prompt reuse
+// KV entries computed by another slot (via llama_kv_cache_seq_cp) instead of
+// re-evaluating a shared prefix.
+struct token_prefix_index {
+    struct node {
+        std::unordered_map<llama_token, node *> children;
+        std::set<int> slots; // slots whose cached tokens pass through this node
+
+        ~node() {
+            for (auto & child : children) {
+                delete child.second;
+            }
+        }
+    };
+
+    node root;
+
+    // index the first n tokens of a slot's cache
+    void insert(int slot_id, const std::vector<llama_token> & tokens, size_t n) {
+        node *cur = &root;
+        n = std::min(n, tokens.size());
+        for (size_t i = 0; i < n; i++) {
+            auto it = cur->children.find(tokens[i]);
+            if (it == cur->children.end()) {
+                it = cur->children.emplace(tokens[i], new node()).first;
+            }
+            cur = it->second;
+            cur->slots.insert(slot_id);
+        }
+    }
+
+    // drop all entries belonging to a slot, pruning nodes that become empty
+    void erase(int slot_id) {
+        erase_rec(&root, slot_id);
+    }
+
+    // drop the whole index, e.g. after the KV cache has been cleared
+    void clear() {
+        for (auto & child : root.children) {
+            delete child.second;
+        }
+        root.children.clear();
+    }
+
+    // longest indexed prefix of `tokens` held by a slot other than `self_id`.
+    // returns its length and sets `slot_id` to the slot holding it
+    size_t find(const std::vector<llama_token> & tokens, int self_id, int & slot_id) {
+        node *cur = &root;
+        size_t len = 0;
+        slot_id = -1;
+        for (size_t i = 0; i < tokens.size(); i++) {
+            auto it = cur->children.find(tokens[i]);
+            if (it == cur->children.end()) {
+                break;
+            }
+            cur = it->second;
+            int donor = -1;
+            for (int id : cur->slots) {
+                if (id != self_id) {
+                    donor = id;
+                    break;
+                }
+            }
+            if (donor == -1) {
+                break;
+            }
+            slot_id = donor;
+            len = i + 1;
+        }
+        return len;
+    }
+
+private:
+    static void erase_rec(node *cur, int slot_id) {
+        for (auto it = cur->children.begin(); it != cur->children.end();) {
+            node *child = it->second;
+            child->slots.erase(slot_id);
+            if (child->slots.empty()) {
+                delete child;
+                it = cur->children.erase(it);
+            } else {
+                erase_rec(child, slot_id);
+                ++it;
+            }
+        }
+    }
+};
+
 //
 // other common utils
 //
@@ -574,31 +1101,13 @@ static size_t common_part(const std::vector<llama_token> &a, const std::vector<l
     return i;
 }
 
-static bool ends_with(const std::string &str, const std::string &suffix)
-{
-    return str.size() >= suffix.size() &&
-           0 == str.compare(str.size() - suffix.size(), suffix.size(), suffix);
-}
-
-static size_t find_partial_stop_string(const std::string &stop,
-                                       const std::string &text)
+static size_t common_part(const std::string &a, const std::string &b)
 {
-    if (!text.empty() && !stop.empty())
+    size_t i;
+    for (i = 0; i < a.size() && i < b.size() && a[i] == b[i]; i++)
     {
-        const char text_last_char = text.back();
-        for (int64_t char_index = stop.size() - 1; char_index >= 0; char_index--)
-        {
-            if (stop[char_index] == text_last_char)
-            {
-                const std::string current_partial = stop.substr(0, char_index + 1);
-                if (ends_with(text, current_partial))
-                {
-                    return text.size() - char_index - 1;
-                }
-            }
-        }
     }
-    return std::string::npos;
+    return i;
 }
 
 // TODO: reuse llama_detokenize
@@ -606,6 +1115,9 @@ template <class Iter>
 static std::string tokens_to_str(llama_context *ctx, Iter begin, Iter end)
 {
     std::string ret;
+    // most pieces are a few bytes; one upfront reservation avoids the
+    // repeated reallocation that made long detokenizations quadratic
+    ret.reserve(4 * std::distance(begin, end));
     for (; begin != end; ++begin)
     {
         ret += llama_token_to_piece(ctx, *begin);
@@ -613,6 +1125,59 @@ static std::string tokens_to_str(llama_context *ctx, Iter begin, Iter end)
     return ret;
 }
 
+// tracks how many UTF-8 continuation bytes the byte stream still owes, so
+// the "incomplete multibyte character at the end" test is O(new bytes)
+// instead of a rescan of the accumulated text
+struct utf8_stream_state {
+    int n_remaining = 0; // continuation bytes still expected
+
+    void push(const std::string & bytes)
+    {
+        for (const char ch : bytes)
+        {
+            const unsigned char c = ch;
+            if ((c & 0xC0) == 0x80)
+            {
+                // continuation byte: 10xxxxxx
+                if (n_remaining > 0)
+                {
+                    n_remaining--;
+                }
+            }
+            else if ((c & 0xE0) == 0xC0)
+            {
+                // 2-byte character: 110xxxxx ...
+                n_remaining = 1;
+            }
+            else if ((c & 0xF0) == 0xE0)
+            {
+                // 3-byte character: 1110xxxx ...
+                n_remaining = 2;
+            }
+            else if ((c & 0xF8) == 0xF0)
+            {
+                // 4-byte character: 11110xxx ...
+                n_remaining = 3;
+            }
+            else
+            {
+                // 1-byte character or invalid byte
+                n_remaining = 0;
+            }
+        }
+    }
+
+    bool incomplete() const
+    {
+        return n_remaining > 0;
+    }
+
+    void reset()
+    {
+        n_remaining = 0;
+    }
+};
+
 // format incomplete utf-8 multibyte character for output
 static std::string tokens_to_output_formatted_string(const llama_context *ctx, const llama_token token)
 {